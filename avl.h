@@ -2,30 +2,432 @@
 #define AVL_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <string>
 #include <utility>
 #include <algorithm>
+#include <functional>
 #include <initializer_list>
+#include <istream>
+#include <memory_resource>
+#include <ostream>
+#include <type_traits>
+#include <vector>
 
 namespace avl {
 
+template<class T, class = void>
+struct is_hashable : std::false_type {};
+
+template<class T>
+struct is_hashable<T, std::void_t<decltype(
+    std::hash<T>()(std::declval<const T&>()))> > : std::true_type {};
+
+// Three-way key comparison, optionally short-cut by a small prefix that Set
+// caches in every node next to the links.
 template<class ValueType>
+struct KeyPrefix {
+    struct type {};
+
+    static type make(const ValueType&) {
+        return type();
+    }
+
+    static int compare(const ValueType& a, const type&,
+                       const ValueType& b, const type&) {
+        if (a < b)
+            return -1;
+        if (b < a)
+            return 1;
+        return 0;
+    }
+};
+
+// The first eight bytes of a string packed big-endian, so that comparing
+// prefixes as integers orders like the strings and most comparisons never
+// touch the heap buffer.
+template<>
+struct KeyPrefix<std::string> {
+    struct type {
+        uint64_t bits;
+    };
+
+    static type make(const std::string& s) {
+        uint64_t bits = 0;
+        size_t n = std::min<size_t>(s.size(), 8);
+        for (size_t i = 0; i < n; ++i)
+            bits |= uint64_t(static_cast<unsigned char>(s[i])) << (56 - 8 * i);
+        return type{bits};
+    }
+
+    static int compare(const std::string& a, const type& pa,
+                       const std::string& b, const type& pb) {
+        if (pa.bits != pb.bits)
+            return (pa.bits < pb.bits ? -1 : 1);
+        int c = (a.size() >= 8 && b.size() >= 8 ?
+                 a.compare(8, std::string::npos, b, 8, std::string::npos) :
+                 a.compare(b));
+        return (c < 0 ? -1 : (c > 0 ? 1 : 0));
+    }
+};
+
+// Balancing policies for Set. Each one restores its invariant at a node
+// whose subtrees are valid (fix, given the tree's rotation), tells _join
+// which side to descend into (join_side: 0 or 1, or -1 to attach there)
+// and checks the invariant at one node (valid).
+// Node::height holds the height, or the rank plus one, with null at 0;
+// derived says whether it follows from the children alone, and weighted
+// whether fix reads the sizes, so that any insert or erase below a node can
+// unbalance it even when no height changes.
+
+// Strict AVL: heights of siblings differ by at most one. Shallowest
+// trees, so the best choice for lookup-heavy sets.
+struct AvlBalance {
+    static constexpr bool derived = true;
+    static constexpr bool weighted = false;
+
+    template<class Node>
+    static int get_balance(const Node *N) {
+        int left = static_cast<int>(N->child[0] ? N->child[0]->height : 0);
+        int right = static_cast<int>(N->child[1] ? N->child[1]->height : 0);
+        return left - right;
+    }
+
+    template<class Node, class Rotate>
+    static Node *fix(Node *N, Rotate rotate) {
+        int bal = get_balance(N);
+
+        if (bal > 1 || bal < -1) {
+            int d = (bal < -1);  // heavy side
+            int inner = (d ? get_balance(N->child[d]) > 0 :
+                             get_balance(N->child[d]) < 0);
+            if (inner)  // LR, RL
+                N->child[d] = rotate(N->child[d], d);
+            return rotate(N, !d);  // LL, RR
+        }
+
+        return N;
+    }
+
+    template<class Node>
+    static bool valid(const Node *N) {
+        int bal = get_balance(N);
+        return bal >= -1 && bal <= 1;
+    }
+
+    template<class Node>
+    static int join_side(const Node *L, const Node *R) {
+        size_t hl = (L ? L->height : 0);
+        size_t hr = (R ? R->height : 0);
+        if (hl > hr + 1)
+            return 0;
+        if (hr > hl + 1)
+            return 1;
+        return -1;
+    }
+};
+
+// Weight balance with the (3, 2) parameters: neither subtree weighs more
+// than three times the other, weights being live sizes plus one. It reuses
+// Node::size and rotates less often than AVL. Tombstones weigh nothing, so
+// under lazy erase the shape may drift until the next purge.
+struct WeightBalance {
+    static constexpr bool derived = true;
+    static constexpr bool weighted = true;
+
+    template<class Node>
+    static size_t weight(const Node *N) {
+        return (N ? N->size : 0) + 1;
+    }
+
+    template<class Node, class Rotate>
+    static Node *fix(Node *N, Rotate rotate) {
+        size_t wl = weight(N->child[0]);
+        size_t wr = weight(N->child[1]);
+        if (wl <= 3 * wr && wr <= 3 * wl)
+            return N;
+        int d = (wr > 3 * wl);  // heavy side
+        Node *C = N->child[d];
+        if (weight(C->child[!d]) >= 2 * weight(C->child[d]))
+            N->child[d] = rotate(C, d);
+        return rotate(N, !d);
+    }
+
+    template<class Node>
+    static bool valid(const Node *N) {
+        size_t wl = weight(N->child[0]);
+        size_t wr = weight(N->child[1]);
+        return wl <= 3 * wr && wr <= 3 * wl;
+    }
+
+    template<class Node>
+    static int join_side(const Node *L, const Node *R) {
+        if (weight(L) > 3 * weight(R))
+            return 0;
+        if (weight(R) > 3 * weight(L))
+            return 1;
+        return -1;
+    }
+};
+
+// Weak AVL: rank differences of one or two, leaves at rank zero. Behaves
+// as AVL under insertions only, and needs at most two rotations per erase.
+struct WavlBalance {
+    static constexpr bool derived = false;
+    static constexpr bool weighted = false;
+
+    template<class Node>
+    static int rank(const Node *N) {
+        return static_cast<int>(N ? N->height : 0);
+    }
+
+    template<class Node, class Rotate>
+    static Node *fix(Node *N, Rotate rotate) {
+        int diff[2] = {rank(N) - rank(N->child[0]),
+                       rank(N) - rank(N->child[1])};
+
+        if (diff[0] == 0 || diff[1] == 0) {  // a child was promoted
+            int d = (diff[1] == 0);
+            Node *C = N->child[d];
+            if (diff[!d] == 1) {
+                ++N->height;
+                return N;
+            }
+            if (rank(C) - rank(C->child[d]) == 1) {
+                C = rotate(N, !d);
+                --N->height;
+                return C;
+            }
+            Node *Y = C->child[!d];
+            N->child[d] = rotate(C, d);
+            rotate(N, !d);
+            ++Y->height;
+            --C->height;
+            --N->height;
+            return Y;
+        }
+
+        if (!N->child[0] && !N->child[1]) {  // a 2,2 leaf
+            N->height = 1;
+            return N;
+        }
+
+        if (diff[0] == 3 || diff[1] == 3) {  // a child was demoted
+            int d = (diff[1] == 3);
+            Node *Y = N->child[!d];
+            if (diff[!d] == 2) {
+                --N->height;
+                return N;
+            }
+            if (rank(Y) - rank(Y->child[0]) == 2 &&
+                rank(Y) - rank(Y->child[1]) == 2) {
+                --N->height;
+                --Y->height;
+                return N;
+            }
+            if (rank(Y) - rank(Y->child[!d]) == 1) {
+                rotate(N, d);
+                ++Y->height;
+                --N->height;
+                if (!N->child[0] && !N->child[1])
+                    --N->height;
+                return Y;
+            }
+            Node *Z = Y->child[d];
+            N->child[!d] = rotate(Y, !d);
+            rotate(N, d);
+            Z->height += 2;
+            --Y->height;
+            N->height -= 2;
+            return Z;
+        }
+
+        return N;
+    }
+
+    template<class Node>
+    static bool valid(const Node *N) {
+        for (int d = 0; d < 2; ++d) {
+            int diff = rank(N) - rank(N->child[d]);
+            if (diff < 1 || diff > 2)
+                return false;
+        }
+        return N->child[0] || N->child[1] || N->height == 1;
+    }
+
+    template<class Node>
+    static int join_side(const Node *L, const Node *R) {
+        return AvlBalance::join_side(L, R);
+    }
+};
+
+// Link-level steps shared by the pointer-linked trees (Set, IntrusiveSet),
+// for any node type with child[2] and a parent link P.
+
+template<class Node>
+Node *tree_last(Node *N, int d) {
+    if (!N)
+        return nullptr;
+    while (N->child[d])
+        N = N->child[d];
+    return N;
+}
+
+// In-order neighbour of N in direction d.
+template<class Node>
+Node *tree_step(Node *N, int d) {
+    if (!N)
+        return nullptr;
+    if (N->child[d])
+        return tree_last(N->child[d], !d);
+    while (N->P) {
+        if (N->P->child[!d] == N) {
+            return N->P;
+        }
+        N = N->P;
+    }
+    return nullptr;
+}
+
+// Rotates N down towards d; its child on the other side takes its place.
+// update recomputes a node from its children and fixes their P links.
+template<class Node, class Update>
+Node *tree_rotate(Node *N, int d, Update update) {
+    Node *C = N->child[!d];
+    Node *T = C->child[d];
+
+    C->child[d] = N;
+    N->child[!d] = T;
+
+    C->P = N->P;
+
+    update(N);
+    update(C);
+
+    return C;
+}
+
+template<class ValueType, class Balance = AvlBalance>
 class Set {
  private:
-    struct Node {
+    typedef KeyPrefix<ValueType> Traits;
+    typedef typename Traits::type Prefix;
+
+    // Keys like int or double travel in registers and take the branch-free
+    // descent; everything else is passed by reference.
+    static constexpr bool small_key =
+        std::is_trivially_copyable<ValueType>::value &&
+        sizeof(ValueType) <= 2 * sizeof(void *);
+
+    typedef typename std::conditional<small_key, ValueType,
+                                      const ValueType&>::type key_arg;
+
+    struct Node : Prefix {
         ValueType key;
-        Node *L, *R, *P;
-        size_t height;
+        Node *child[2];
+        Node *P;
+        uint32_t height;
+        uint8_t dirty;  // relaxed mode: see stale below
+        bool dead;      // lazily erased; size counts live nodes only
         size_t size;
 
         explicit Node(ValueType key):
+        Prefix(Traits::make(key)),
         key(std::move(key)),
-        L(nullptr),
-        R(nullptr),
+        child{nullptr, nullptr},
         P(nullptr),
         height(1),
+        dirty(0),
+        dead(false),
         size(1) {}
     } *root;
 
+    // Nodes come from the heap when resource is null. A monotonic resource
+    // frees nothing on deallocate, so the whole tree is dropped at once.
+    std::pmr::memory_resource *resource;
+    bool bulk_release;
+
+    // While a transaction is open, erased nodes are parked here instead of
+    // being freed, inserted ones are remembered so they can be unlinked,
+    // and revived tombstones so they can be marked dead again.
+    struct Undo {
+        enum Kind { inserted, erased, revived };
+
+        Node *node;
+        Kind kind;
+    };
+
+    std::vector<Undo> undo;
+    bool in_txn;
+
+    // In relaxed mode (slack > 0) inserts and erases outside a transaction
+    // skip the rotations. The node whose subtree changed is flagged stale,
+    // and each ancestor gets bit d of dirty while child[d] leads to stale
+    // nodes, which repair_step() follows down. pending counts stale nodes.
+    static constexpr uint8_t stale = 4;
+    size_t slack;
+    size_t pending;
+
+    // With purge_ratio > 0, erase leaves a tombstone; once dead reaches that
+    // fraction of the nodes the tree is rebuilt from the live ones.
+    double purge_ratio;
+    size_t dead;
+
+    // Direct-mapped cache of recent find() results by key hash. Empty when
+    // off; a slot is cleared when its node leaves the tree.
+    mutable std::vector<Node *> cache;
+    mutable size_t hits;
+    mutable size_t misses;
+
+    // Optional hash index over every node in the tree, tombstones included:
+    // linear probing in a power-of-two table at most three quarters full.
+    // Empty when off.
+    struct Slot {
+        size_t hash;
+        Node *node;
+    };
+
+    std::vector<Slot> index;
+    size_t indexed;
+
+    template<typename Key>
+    static Node *create_node(std::pmr::memory_resource *res, Key&& key) {
+        if (!res)
+            return new Node(std::forward<Key>(key));
+        void *mem = res->allocate(sizeof(Node), alignof(Node));
+        try {
+            return new (mem) Node(std::forward<Key>(key));
+        } catch (...) {
+            res->deallocate(mem, sizeof(Node), alignof(Node));
+            throw;
+        }
+    }
+
+    static void free_node(std::pmr::memory_resource *res, Node *N) {
+        if (!N)
+            return;
+        if (!res) {
+            delete N;
+            return;
+        }
+        N->~Node();
+        res->deallocate(N, sizeof(Node), alignof(Node));
+    }
+
+    // A search key with its prefix computed once per operation.
+    struct Probe {
+        key_arg key;
+        Prefix prefix;
+
+        explicit Probe(key_arg key):
+        key(key),
+        prefix(Traits::make(key)) {}
+    };
+
+    static int compare(const Probe& K, const Node *N) {
+        return Traits::compare(K.key, K.prefix, N->key, *N);
+    }
+
     static size_t get_height(const Node *N) {
         return (N ? N->height : 0);
     }
@@ -37,226 +439,878 @@ class Set {
     static void recalc_node(Node *N) {
         if (!N)
             return;
-        N->height = std::max(get_height(N->L), get_height(N->R)) + 1;
-        N->size = get_size(N->L) + get_size(N->R) + 1;
+        if constexpr (Balance::derived)
+            N->height = std::max(get_height(N->child[0]),
+                                 get_height(N->child[1])) + 1;
+        N->size = get_size(N->child[0]) + get_size(N->child[1]) +
+                  (N->dead ? 0 : 1);
         recalc_par(N);
     }
 
     static void recalc_par(Node *N) {
         if (!N)
             return;
-        if (N->L) {
-            N->L->P = N;
+        if (N->child[0]) {
+            N->child[0]->P = N;
         }
-        if (N->R) {
-            N->R->P = N;
+        if (N->child[1]) {
+            N->child[1]->P = N;
         }
     }
 
-    static Node *left_rotate(Node *N) {
-        Node *C = N->R;
-        Node *T = C->L;
-
-        C->L = N;
-        N->R = T;
+    static Node *rotate(Node *N, int d) {
+        return tree_rotate(N, d, &recalc_node);
+    }
 
-        C->P = N->P;
+    // Recomputes N from its children whatever the policy, for nodes
+    // placed over two valid subtrees (build, join); every policy accepts
+    // the result.
+    static void init_node(Node *N) {
+        N->height = std::max(get_height(N->child[0]),
+                             get_height(N->child[1])) + 1;
+        recalc_node(N);
+    }
 
+    static Node *rebalance(Node *N) {
         recalc_node(N);
-        recalc_node(C);
+        return Balance::fix(N, &rotate);
+    }
 
-        return C;
+    Node *_insert(Node *N, const Probe& K, Node *&res) {
+        if (!N) {
+            res = create_node(resource, K.key);
+            index_add(res);
+            return res;
+        }
+
+        int c = compare(K, N);
+        if (c == 0) {
+            if (N->dead)
+                revive(N);
+            res = N;
+            return N;
+        }
+
+        int d = (c > 0);
+        N->child[d] = _insert(N->child[d], K, res);
+
+        return rebalance(N);
+    }
+
+    // Links the detached node X, or leaves it alone if its key is taken.
+    // A tombstone holding the key is replaced by X and returned in tomb.
+    static Node *_link(Node *N, Node *X, Node *&res, Node *&tomb) {
+        if (!N) {
+            res = X;
+            return X;
+        }
+
+        int c = Traits::compare(X->key, *X, N->key, *N);
+        if (c == 0) {
+            if (!N->dead) {
+                res = N;
+                return N;
+            }
+            X->child[0] = N->child[0];
+            X->child[1] = N->child[1];
+            X->height = N->height;
+            X->dirty = N->dirty;
+            tomb = N;
+            res = X;
+            return rebalance(X);
+        }
+
+        int d = (c > 0);
+        N->child[d] = _link(N->child[d], X, res, tomb);
+
+        return rebalance(N);
     }
 
-    static Node *right_rotate(Node *N) {
-        Node *C = N->L;
-        Node *T = C->R;
+    static Node *get_last(Node *N, int d) {
+        return tree_last(N, d);
+    }
 
-        C->R = N;
-        N->L = T;
+    static Node *get_left(Node *N) {
+        return get_last(N, 0);
+    }
 
-        C->P = N->P;
+    static Node *get_right(Node *N) {
+        return get_last(N, 1);
+    }
 
-        recalc_node(N);
-        recalc_node(C);
+    static Node *get_step(Node *N, int d) {
+        return tree_step(N, d);
+    }
 
-        return C;
+    // Iteration steps over tombstones.
+    static Node *get_next(Node *N) {
+        do {
+            N = get_step(N, 1);
+        } while (N && N->dead);
+        return N;
     }
 
-    static int get_balance(const Node *N) {
-        int left_height = static_cast<int>(get_height(N->L));
-        int right_height = static_cast<int>(get_height(N->R));
-        return left_height - right_height;
+    static Node *get_prev(Node *N) {
+        do {
+            N = get_step(N, 0);
+        } while (N && N->dead);
+        return N;
     }
 
-    static Node *_insert(Node *N, const ValueType& key) {
-        if (!N) {
-            return new Node(key);
+    static Node *first_live(Node *N) {
+        N = get_left(N);
+        return (N && N->dead ? get_next(N) : N);
+    }
+
+    static Node *last_live(Node *N) {
+        N = get_right(N);
+        return (N && N->dead ? get_prev(N) : N);
+    }
+
+    static Node *_remove_min(Node *N, Node *&M) {
+        if (!(N->child[0])) {
+            M = N;
+            return N->child[1];
         }
+        N->child[0] = _remove_min(N->child[0], M);
+        return rebalance(N);
+    }
 
-        if (key < N->key) {
-            N->L = _insert(N->L, key);
-        } else if (N->key < key) {
-            N->R = _insert(N->R, key);
-        } else {
+    // Unlinks the node holding key without moving keys between nodes,
+    // so the detached node and all the remaining ones keep their identity.
+    static Node *_erase(Node *N, const Probe& K, Node *&res) {
+        if (!N)
+            return nullptr;
+        int c = compare(K, N);
+        if (c != 0) {
+            int d = (c > 0);
+            N->child[d] = _erase(N->child[d], K, res);
+        } else if (N->dead) {
             return N;
+        } else {
+            res = N;
+            if (!(N->child[0]) || !(N->child[1]))
+                return (N->child[0] ? N->child[0] : N->child[1]);
+            Node *M = nullptr;
+            Node *R = _remove_min(N->child[1], M);
+            M->child[0] = N->child[0];
+            M->child[1] = R;
+            M->height = N->height;
+            N = M;
         }
 
-        recalc_node(N);
+        return rebalance(N);
+    }
 
-        int bal = get_balance(N);
+    // Joins L < K < R, whose heights may differ arbitrarily, into one tree.
+    static Node *_join(Node *L, Node *K, Node *R) {
+        int side = Balance::join_side(L, R);
+        if (side == 0) {
+            L->child[1] = _join(L->child[1], K, R);
+            return rebalance(L);
+        }
+        if (side == 1) {
+            R->child[0] = _join(L, K, R->child[0]);
+            return rebalance(R);
+        }
+        K->child[0] = L;
+        K->child[1] = R;
+        init_node(K);
+        return K;
+    }
+
+    // Splits N into the keys less than key and the rest.
+    static void _split(Node *N, const Probe& K, Node *&L, Node *&R) {
+        if (!N) {
+            L = R = nullptr;
+            return;
+        }
+        Node *A = N->child[0];
+        Node *B = N->child[1];
+        Node *T = nullptr;
+        if (compare(K, N) > 0) {
+            _split(B, K, T, R);
+            L = _join(A, N, T);
+        } else {
+            _split(A, K, L, T);
+            R = _join(T, N, B);
+        }
+    }
+
+    // Brings every dirty subtree below N back into balance bottom-up: the
+    // clean subtrees are valid, and _join of two valid trees is valid.
+    static Node *repair(Node *N) {
+        if (!N || !N->dirty)
+            return N;
+        N->dirty = 0;
+        Node *L = repair(N->child[0]);
+        Node *R = repair(N->child[1]);
+        return _join(L, N, R);
+    }
+
+    // Flags N stale and the path above it, stopping at the first ancestor
+    // already flagged. Heights are left as they were, so that the repair
+    // can tell whether the change reaches the parent.
+    void mark_path(Node *N) {
+        if (!N)
+            return;
+        if (!(N->dirty & stale)) {
+            N->dirty |= stale;
+            ++pending;
+        }
+        for (Node *P = N->P; P; N = P, P = P->P) {
+            uint8_t bit = (P->child[1] == N ? 2 : 1);
+            if (P->dirty & bit)
+                break;
+            P->dirty |= bit;
+        }
+    }
 
-        if (bal > 1) {
-            if (key < N->L->key) {  // LL
-                return right_rotate(N);
-            } else {  // LR
-                N->L = left_rotate(N->L);
-                return right_rotate(N);
+    // Recomputes the direction bits of N after its children were replaced.
+    static void mark_children(Node *N) {
+        N->dirty &= stale;
+        for (int d = 0; d < 2; ++d) {
+            if (N->child[d] && N->child[d]->dirty)
+                N->dirty |= (1 << d);
+        }
+    }
+
+    // Joins the valid subtrees of the stale node N and carries the repair
+    // up while the height changes (always, under a weighted policy), as an
+    // eager write would. Returns false if it had to stop at a parent whose
+    // other subtree is still dirty, which then turns stale in N's place.
+    bool repair_up(Node *N) {
+        N->dirty = 0;
+        --pending;
+        Node *P;
+        for (;;) {
+            P = N->P;
+            int d = (P && P->child[1] == N);
+            uint32_t height = N->height;
+            Node *C = _join(N->child[0], N, N->child[1]);
+            if (!P) {
+                set_root(C);
+                return true;
             }
-        } else if (bal < -1) {
-            if (key < N->R->key) {  // RL
-                N->R = right_rotate(N->R);
-                return left_rotate(N);
-            } else {  // RR
-                return left_rotate(N);
+            P->child[d] = C;
+            C->P = P;
+            P->dirty &= ~(1 << d);
+            if (!Balance::weighted && C->height == height)
+                break;
+            if (P->dirty & stale)
+                return true;
+            if (P->dirty) {
+                P->dirty |= stale;
+                ++pending;
+                return false;
             }
+            N = P;
         }
+        // Height unchanged: only the bits leading here need clearing.
+        for (; !P->dirty && P->P; P = P->P)
+            P->P->dirty &= ~(P->P->child[1] == P ? 2 : 1);
+        return true;
+    }
 
-        return N;
+    // One bounded unit of deferred rebalancing: retires at least one stale
+    // node, repairing from a lowest one. The work is that of the eager
+    // writes it stands in for. False if nothing is pending.
+    bool repair_step() {
+        for (;;) {
+            Node *N = root;
+            if (!N || !N->dirty)
+                return false;
+            while (N->dirty & 3)
+                N = N->child[(N->dirty & 1) ? 0 : 1];
+            if (repair_up(N))
+                return true;
+        }
     }
 
-    static Node *get_left(Node *N) {
-        if (!N) {
-            return nullptr;
+    // Resolves several ascending ranks in one descent: each node is visited
+    // once however many of the ranks lie below it.
+    static void _select(Node *N, const size_t *ranks, size_t count,
+                        size_t offset, Node **out) {
+        if (!N || count == 0)
+            return;
+        size_t mid = offset + get_size(N->child[0]);
+        size_t left = 0;
+        while (left < count && ranks[left] < mid)
+            ++left;
+        _select(N->child[0], ranks, left, offset, out);
+        size_t i = left;
+        if (!N->dead) {
+            while (i < count && ranks[i] == mid)
+                out[i++] = N;
+            ++mid;
         }
-        if (!(N->L)) {
-            return N;
+        _select(N->child[1], ranks + i, count - i, mid, out + i);
+    }
+
+    // One comparison per level and no data-dependent branch: the last node
+    // not less than the key is carried along and checked at the bottom.
+    static Node *_descend(Node *N, key_arg key) {
+        Node *res = nullptr;
+        while (N) {
+            bool right = N->key < key;
+            res = (right ? res : N);
+            N = N->child[right];
         }
-        return get_left(N->L);
+        return res;
     }
 
-    static Node *get_right(Node *N) {
+    static Node *_find(Node *N, const Probe& K) {
+        if constexpr (small_key) {
+            Node *res = _descend(N, K.key);
+            return (res && !(K.key < res->key) && !res->dead ? res : nullptr);
+        }
         if (!N) {
             return nullptr;
         }
-        if (!(N->R)) {
-            return N;
-        }
-        return get_right(N->R);
+        int c = compare(K, N);
+        if (c == 0)
+            return (N->dead ? nullptr : N);
+        return _find(N->child[c > 0], K);
     }
 
-    static Node *get_next(Node *N) {
+    static Node *_lower_bound(Node *N, const Probe& K) {
+        if constexpr (small_key)
+            return _descend(N, K.key);
         if (!N)
             return nullptr;
-        if (N->R)
-            return get_left(N->R);
-        while (N->P) {
-            if (N->P->L == N) {
-                return N->P;
+        int c = compare(K, N);
+        if (c == 0)
+            return N;
+        if (c < 0) {
+            Node *res = _lower_bound(N->child[0], K);
+            if (!res)
+                res = N;
+            return res;
+        }
+        return _lower_bound(N->child[1], K);
+    }
+
+    static void prefetch(const Node *N) {
+#if defined(__GNUC__)
+        __builtin_prefetch(N);
+#else
+        (void)N;
+#endif
+    }
+
+    // Number of descents _lookup_batch keeps in flight.
+    static constexpr size_t batch_width = 16;
+
+    // Runs the _descend loop for keys[0, n) batch_width at a time, taking
+    // one step of each in turn: a step prefetches the next node and moves on
+    // to the other lookups, so by the time it comes round again the line
+    // has had a whole round to arrive. Each result goes to done(i, N); with
+    // exact, misses give nullptr.
+    template<typename F>
+    static void _lookup_batch(Node *root, const ValueType *keys, size_t n,
+                              bool exact, F done) {
+        struct Cursor {
+            Node *N;
+            Node *res;
+            size_t i;
+        } cur[batch_width];
+
+        size_t live = 0, next = 0;
+        prefetch(root);
+        while (live < batch_width && next < n)
+            cur[live++] = Cursor{root, nullptr, next++};
+
+        while (live > 0) {
+            size_t j = 0;
+            while (j < live) {
+                Cursor &C = cur[j];
+                if (C.N) {
+                    bool right = C.N->key < keys[C.i];
+                    C.res = (right ? C.res : C.N);
+                    C.N = C.N->child[right];
+                    prefetch(C.N);
+                    ++j;
+                    continue;
+                }
+                Node *res = C.res;
+                if (exact && res && (keys[C.i] < res->key || res->dead))
+                    res = nullptr;
+                if (res && res->dead)
+                    res = get_next(res);
+                done(C.i, res);
+                if (next < n) {
+                    C = Cursor{root, nullptr, next++};
+                    ++j;
+                } else {
+                    C = cur[--live];
+                }
             }
-            N = N->P;
         }
-        return nullptr;
     }
 
-    static Node *get_prev(Node *N) {
+    template<typename F>
+    static void walk(Node *N, F &f) {
         if (!N)
-            return nullptr;
-        if (N->L)
-            return get_right(N->L);
-        while (N->P) {
-            if (N->P->R == N) {
-                return N->P;
-            }
-            N = N->P;
+            return;
+        walk(N->child[0], f);
+        if (!N->dead)
+            f(N->key);
+        walk(N->child[1], f);
+    }
+
+    // Checks the subtree at N against the keys lo < key < hi bounding it
+    // and counts its nodes, tombstones and stale nodes.
+    bool _check(const Node *N, const Node *lo, const Node *hi, bool balanced,
+                size_t &nodes, size_t &tombs, size_t &stales) const {
+        if (!N)
+            return true;
+        if ((lo && !(lo->key < N->key)) || (hi && !(N->key < hi->key)))
+            return false;
+        for (int d = 0; d < 2; ++d) {
+            if (N->child[d] && N->child[d]->P != N)
+                return false;
         }
-        return nullptr;
+        if (N->size != get_size(N->child[0]) + get_size(N->child[1]) +
+                       (N->dead ? 0 : 1))
+            return false;
+        for (int d = 0; d < 2; ++d) {
+            bool below = (N->child[d] && N->child[d]->dirty);
+            if (below != bool(N->dirty & (1 << d)))
+                return false;
+        }
+        if (Balance::derived && !N->dirty &&
+            N->height != std::max(get_height(N->child[0]),
+                                  get_height(N->child[1])) + 1)
+            return false;
+        if (balanced && !Balance::valid(N))
+            return false;
+        if (!index.empty() && !N->dead && index_find(N->key) != N)
+            return false;
+        ++nodes;
+        tombs += (N->dead ? 1 : 0);
+        stales += ((N->dirty & stale) ? 1 : 0);
+        return _check(N->child[0], lo, N, balanced, nodes, tombs, stales) &&
+               _check(N->child[1], N, hi, balanced, nodes, tombs, stales);
+    }
+
+    static void _copy(const Node *N, ValueType *out, size_t n, size_t &i) {
+        if (!N || i == n)
+            return;
+        _copy(N->child[0], out, n, i);
+        if (i < n && !N->dead)
+            out[i++] = N->key;
+        _copy(N->child[1], out, n, i);
     }
 
-    static Node *_erase(Node *N, const ValueType& key) {
+    void destroy(Node *N) {
         if (!N)
+            return;
+        destroy(N->child[0]);
+        destroy(N->child[1]);
+        free_node(resource, N);
+    }
+
+    // Builds a perfectly balanced tree from the next n keys of a sorted
+    // range. On failure every node made so far is freed before rethrowing.
+    template<typename Iter>
+    Node *build(Iter &it, size_t n) {
+        if (n == 0)
             return nullptr;
-        if (key < N->key) {
-            N->L = _erase(N->L, key);
-        } else if (N->key < key) {
-            N->R = _erase(N->R, key);
+        size_t left = n / 2;
+        Node *L = build(it, left);
+        Node *N = nullptr;
+        Node *R = nullptr;
+        try {
+            N = create_node(resource, *it);
+            ++it;
+            R = build(it, n - left - 1);
+        } catch (...) {
+            destroy(L);
+            free_node(resource, N);
+            throw;
+        }
+        N->child[0] = L;
+        N->child[1] = R;
+        init_node(N);
+        return N;
+    }
+
+    // Parks a detached subtree in the undo log node by node.
+    void discard_tree(Node *N) {
+        if (!N)
+            return;
+        discard_tree(N->child[0]);
+        discard_tree(N->child[1]);
+        reset_node(N);
+        undo.push_back({N, Undo::erased});
+    }
+
+    void destroy_all() {
+        if (!bulk_release || !std::is_trivially_destructible<ValueType>::value)
+            destroy(root);
+        root = nullptr;
+        std::fill(cache.begin(), cache.end(), nullptr);
+        std::fill(index.begin(), index.end(), Slot{0, nullptr});
+        indexed = 0;
+    }
+
+    static size_t key_hash(const ValueType& key) {
+        if constexpr (is_hashable<ValueType>::value) {
+            return std::hash<ValueType>()(key);
         } else {
-            if (!(N->L) || !(N->R)) {
-                Node *T = (N->L ? N->L : N->R);
-                if (!T) {
-                    T = N;
-                    N = nullptr;
-                } else {
-                    *N = *T;
-                }
-                delete T;
-                T = nullptr;
-            } else {
-                Node *T = get_left(N->R);
-                N->key = T->key;
-                N->R = _erase(N->R, T->key);
+            return 0;
+        }
+    }
+
+    size_t cache_slot(const ValueType& key) const {
+        return key_hash(key) & (cache.size() - 1);
+    }
+
+    // Grows the index to take n nodes; adding them then cannot throw.
+    void index_reserve(size_t n) {
+        if (index.empty() || n * 4 <= index.size() * 3)
+            return;
+        size_t cap = index.size();
+        while (n * 4 > cap * 3)
+            cap *= 2;
+        std::vector<Slot> old(cap, Slot{0, nullptr});
+        old.swap(index);
+        for (const Slot& S : old) {
+            if (!S.node)
+                continue;
+            size_t i = S.hash & (cap - 1);
+            while (index[i].node)
+                i = (i + 1) & (cap - 1);
+            index[i] = S;
+        }
+    }
+
+    void index_add(Node *N) {
+        if (index.empty())
+            return;
+        size_t mask = index.size() - 1;
+        size_t h = key_hash(N->key);
+        size_t i = h & mask;
+        while (index[i].node)
+            i = (i + 1) & mask;
+        index[i] = Slot{h, N};
+        ++indexed;
+    }
+
+    // Backward-shift deletion, so lookups never wade through tombstones.
+    void index_remove(Node *N) {
+        if (index.empty())
+            return;
+        size_t mask = index.size() - 1;
+        size_t i = key_hash(N->key) & mask;
+        while (index[i].node != N)
+            i = (i + 1) & mask;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (!index[j].node)
+                break;
+            size_t k = index[j].hash & mask;
+            // Move the entry back unless its home lies cyclically in (i, j].
+            if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+                index[i] = index[j];
+                i = j;
             }
         }
+        index[i].node = nullptr;
+        --indexed;
+    }
 
+    void index_tree(Node *N, bool add) {
         if (!N)
-            return nullptr;
+            return;
+        index_tree(N->child[0], add);
+        index_tree(N->child[1], add);
+        if (add) {
+            index_add(N);
+        } else {
+            index_remove(N);
+        }
+    }
 
-        recalc_node(N);
+    // Refills the index from the tree, which the table must already fit.
+    void reindex() {
+        std::fill(index.begin(), index.end(), Slot{0, nullptr});
+        indexed = 0;
+        index_tree(root, true);
+    }
 
-        int bal = get_balance(N);
+    void build_index() {
+        index.assign(16, Slot{0, nullptr});
+        index_reserve(size() + dead);
+        reindex();
+    }
 
-        if (bal > 1) {
-            if (get_balance(N->L) >= 0) {
-                return right_rotate(N);
-            } else {
-                N->L = left_rotate(N->L);
-                return right_rotate(N);
-            }
-        } else if (bal < -1) {
-            if (get_balance(N->R) <= 0) {
-                return left_rotate(N);
-            } else {
-                N->R = right_rotate(N->R);
-                return left_rotate(N);
-            }
+    Node *index_find(key_arg key) const {
+        size_t mask = index.size() - 1;
+        size_t h = key_hash(key);
+        for (size_t i = h & mask; index[i].node; i = (i + 1) & mask) {
+            const Node *N = index[i].node;
+            if (index[i].hash == h && !(N->key < key) && !(key < N->key))
+                return (N->dead ? nullptr : index[i].node);
         }
+        return nullptr;
+    }
 
-        return N;
+    void forget(Node *N) {
+        if (cache.empty() || !N)
+            return;
+        Node *&slot = cache[cache_slot(N->key)];
+        if (slot == N)
+            slot = nullptr;
     }
 
-    static Node *_find(Node *N, const ValueType& key) {
-        if (!N) {
-            return nullptr;
+    void set_root(Node *N) {
+        root = N;
+        if (root)
+            root->P = nullptr;
+    }
+
+    static void reset_node(Node *N) {
+        N->child[0] = N->child[1] = N->P = nullptr;
+        N->height = 1;
+        N->size = (N->dead ? 0 : 1);
+    }
+
+    Node *unlink(key_arg key) {
+        settle();
+        Node *res = nullptr;
+        set_root(_erase(root, Probe(key), res));
+        if (res) {
+            forget(res);
+            index_remove(res);
+            reset_node(res);
         }
-        if (key < N->key) {
-            return _find(N->L, key);
-        } else if (N->key < key) {
-            return _find(N->R, key);
+        return res;
+    }
+
+    // Hangs C where N hung from its parent.
+    void replace(Node *N, Node *C) {
+        if (C)
+            C->P = N->P;
+        if (!N->P) {
+            root = C;
         } else {
-            return N;
+            N->P->child[N->P->child[1] == N] = C;
+        }
+    }
+
+    // Each relaxed write retires repair_steps stale nodes, and more while
+    // over slack of them are stale, so the backlog shrinks as it grows.
+    static constexpr int repair_steps = 2;
+
+    void note_relaxed() {
+        for (int i = 0; i < repair_steps && repair_step(); ++i) {}
+        while (pending > slack && repair_step()) {}
+    }
+
+    void insert_relaxed(key_arg val) {
+        Probe K(val);
+        Node *N = root;
+        Node *P = nullptr;
+        int d = 0;
+        while (N) {
+            int c = compare(K, N);
+            if (c == 0) {
+                if (N->dead) {
+                    // Sizes on the path grew, which a weight-based policy
+                    // has to repair like any other deferred insert.
+                    revive(N);
+                    if constexpr (Balance::weighted)
+                        mark_path(N);
+                    note_relaxed();
+                }
+                return;
+            }
+            P = N;
+            d = (c > 0);
+            N = N->child[d];
         }
+        Node *X = create_node(resource, K.key);
+        index_add(X);
+        X->P = P;
+        if (P) {
+            P->child[d] = X;
+        } else {
+            root = X;
+        }
+        add_size(P, 1, true);
+        mark_path(P);
+        note_relaxed();
+    }
+
+    // Unlinks like _erase, splicing in the successor node M when X has two
+    // children, but leaves the rotations to repair_step(). M takes over the
+    // height of X, which is what the parent was balanced against.
+    void erase_relaxed(key_arg val) {
+        Node *X = _find(root, Probe(val));
+        if (!X)
+            return;
+        Node *S = X->P;
+        if (X->dirty & stale)
+            --pending;
+        if (!(X->child[0]) || !(X->child[1])) {
+            add_size(S, 1, false);
+            replace(X, (X->child[0] ? X->child[0] : X->child[1]));
+            if (S)
+                mark_children(S);
+        } else {
+            Node *M = get_left(X->child[1]);
+            S = M->P;
+            add_size(S, 1, false);
+            if (S != X) {
+                replace(M, M->child[1]);
+                M->child[1] = X->child[1];
+                mark_children(S);
+            }
+            M->child[0] = X->child[0];
+            M->height = X->height;
+            M->size = X->size;
+            replace(X, M);
+            recalc_par(M);
+            mark_children(M);
+            mark_path(M);
+            if (S == X)
+                S = M;
+        }
+        mark_path(S);
+        forget(X);
+        index_remove(X);
+        reset_node(X);
+        discard(X);
+        note_relaxed();
     }
 
-    static Node *_lower_bound(Node *N, const ValueType& key) {
+    static void add_size(Node *N, size_t n, bool grow) {
+        for (; N; N = N->P)
+            N->size = (grow ? N->size + n : N->size - n);
+    }
+
+    // Inside a transaction the caller has reserved an undo entry.
+    void revive(Node *N) {
+        N->dead = false;
+        --dead;
+        add_size(N, 1, true);
+        if (in_txn)
+            undo.push_back({N, Undo::revived});
+    }
+
+    void bury(Node *N) {
+        N->dead = true;
+        ++dead;
+        add_size(N, 1, false);
+    }
+
+    void erase_lazy(key_arg val) {
+        Node *N = _find(root, Probe(val));
         if (!N)
+            return;
+        bury(N);
+        if (static_cast<double>(dead) >=
+            purge_ratio * static_cast<double>(dead + size()))
+            purge();
+    }
+
+    static size_t count_dead(const Node *N) {
+        if (!N)
+            return 0;
+        return count_dead(N->child[0]) + count_dead(N->child[1]) +
+               (N->dead ? 1 : 0);
+    }
+
+    // Gathers the live nodes in order and frees the tombstones.
+    void collect(Node *N, std::vector<Node *> &live) {
+        if (!N)
+            return;
+        Node *R = N->child[1];
+        collect(N->child[0], live);
+        if (N->dead) {
+            forget(N);
+            free_node(resource, N);
+        } else {
+            live.push_back(N);
+        }
+        collect(R, live);
+    }
+
+    // Links nodes[0, n), in order, into a perfectly balanced tree.
+    static Node *relink(Node **nodes, size_t n) {
+        if (n == 0)
             return nullptr;
-        if (!(key < N->key) && !(N->key < key))
-            return N;
-        if (key < N->key) {
-            Node *res = _lower_bound(N->L, key);
-            if (!res)
-                res = N;
-            return res;
+        size_t left = n / 2;
+        Node *N = nodes[left];
+        N->child[0] = relink(nodes, left);
+        N->child[1] = relink(nodes + left + 1, n - left - 1);
+        N->dirty = 0;
+        init_node(N);
+        return N;
+    }
+
+    // Links X in place of a tombstone with its key, if there is one, and
+    // parks or frees the tombstone. Inside a transaction the caller has
+    // reserved two undo entries.
+    Node *link(Node *X) {
+        Node *res = nullptr;
+        Node *tomb = nullptr;
+        set_root(_link(root, X, res, tomb));
+        if (tomb) {
+            forget(tomb);
+            index_remove(tomb);
+            reset_node(tomb);
+            --dead;
+            discard(tomb);
         }
-        return _lower_bound(N->R, key);
+        return res;
+    }
+
+    void note_insert(Node *N) {
+        if (in_txn)
+            undo.push_back({N, Undo::inserted});
     }
 
-    static void destroy(Node *N) {
+    void discard(Node *N) {
         if (!N)
             return;
-        destroy(N->L);
-        destroy(N->R);
-        delete N;
+        if (in_txn) {
+            undo.push_back({N, Undo::erased});
+        } else {
+            free_node(resource, N);
+        }
+    }
+
+    // Unlinks a node that leaves the set for good. An open transaction
+    // parks the node itself for rollback and hands out a copy instead.
+    Node *take(key_arg key) {
+        Node *N = _find(root, Probe(key));
+        if (!N)
+            return nullptr;
+        if (!in_txn)
+            return unlink(key);
+        undo.reserve(undo.size() + 1);
+        Node *C = create_node(resource, N->key);
+        undo.push_back({unlink(key), Undo::erased});
+        return C;
+    }
+
+    // Nodes may only be relinked into a set drawing from the same resource;
+    // otherwise the key is moved into a fresh node and the old one is freed.
+    Node *adopt(Node *X, std::pmr::memory_resource *from) {
+        if (from == resource)
+            return X;
+        Node *N = nullptr;
+        try {
+            N = create_node(resource, std::move(X->key));
+        } catch (...) {
+            free_node(from, X);
+            throw;
+        }
+        free_node(from, X);
+        return N;
     }
 
  public:
@@ -265,6 +1319,8 @@ class Set {
         Node *cur;
         Node *root;
 
+        friend class Set;
+
      public:
         iterator(): cur(nullptr), root(nullptr) {}
         iterator(Node *N, Node *root): cur(N), root(root) {}
@@ -274,6 +1330,12 @@ class Set {
             root = other.root;
         }
 
+        iterator& operator=(const iterator& other) {
+            cur = other.cur;
+            root = other.root;
+            return *this;
+        }
+
         iterator& operator++() {
             cur = get_next(cur);
             return *this;
@@ -281,7 +1343,7 @@ class Set {
 
         iterator& operator--() {
             if (cur == nullptr) {
-                cur = get_right(root);
+                cur = last_live(root);
             } else {
                 cur = get_prev(cur);
             }
@@ -317,66 +1379,656 @@ class Set {
         }
     };
 
-    Set(): root(nullptr) {}
+    class node_type {
+     private:
+        Node *node;
+        std::pmr::memory_resource *resource;
+
+        friend class Set;
+
+        node_type(Node *N, std::pmr::memory_resource *res):
+        node(N),
+        resource(res) {}
+
+     public:
+        node_type(): node(nullptr), resource(nullptr) {}
+
+        node_type(node_type&& other):
+        node(other.node),
+        resource(other.resource) {
+            other.node = nullptr;
+        }
+
+        node_type& operator=(node_type&& other) {
+            if (this != &other) {
+                free_node(resource, node);
+                node = other.node;
+                resource = other.resource;
+                other.node = nullptr;
+            }
+            return *this;
+        }
+
+        node_type(const node_type&) = delete;
+        node_type& operator=(const node_type&) = delete;
+
+        bool empty() const {
+            return (node == nullptr);
+        }
+
+        explicit operator bool() const {
+            return !empty();
+        }
+
+        ValueType& value() const {
+            return node->key;
+        }
+
+        ~node_type() {
+            free_node(resource, node);
+        }
+    };
+
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
 
+    Set():
+    root(nullptr),
+    resource(nullptr),
+    bulk_release(false),
+    in_txn(false),
+    slack(0),
+    pending(0),
+    purge_ratio(0),
+    dead(0),
+    hits(0),
+    misses(0),
+    indexed(0) {}
+
+    // The resource must outlive the set; copies of the set use the heap.
+    explicit Set(std::pmr::memory_resource *res):
+    root(nullptr),
+    resource(res),
+    bulk_release(
+        dynamic_cast<std::pmr::monotonic_buffer_resource *>(res) != nullptr),
+    in_txn(false),
+    slack(0),
+    pending(0),
+    purge_ratio(0),
+    dead(0),
+    hits(0),
+    misses(0),
+    indexed(0) {}
+
+    // A throwing key constructor or comparison leaves nothing behind: the
+    // partial tree is released and the exception propagates.
     template<typename Iter>
-    Set(Iter start, Iter end): root(nullptr) {
+    Set(Iter start, Iter end, std::pmr::memory_resource *res = nullptr):
+    Set(res) {
         try {
             while (start != end) {
-                root = _insert(root, *start);
+                insert(*start);
                 ++start;
             }
         } catch (...) {
-            destroy(root);
+            destroy_all();
+            throw;
         }
     }
 
-    Set(std::initializer_list<ValueType> elems): root(nullptr) {
-        *this = Set(elems.begin(), elems.end());
+    Set(std::initializer_list<ValueType> elems):
+    Set(elems.begin(), elems.end()) {}
+
+    Set(const Set &other): Set() {
+        auto start = other.begin();
+        set_root(build(start, other.size()));
     }
 
-    Set(const Set &other): root(nullptr) {
-        *this = Set(other.begin(), other.end());
+    Set(Set &&other): Set() {
+        swap(other);
     }
 
+    // Strong guarantee: the copy is built aside and swapped in on success.
+    // Assigning ends an open transaction as if committed.
     Set& operator=(const Set &other) {
         if (root == other.root)
             return *this;
 
-        destroy(root);
-        root = nullptr;
-
+        Set tmp(resource);
+        tmp.slack = slack;
+        tmp.purge_ratio = purge_ratio;
+        tmp.cache.resize(cache.size());
         auto start = other.begin();
-        while (start != other.end()) {
-            root = _insert(root, *start);
-            ++start;
-        }
+        tmp.set_root(tmp.build(start, other.size()));
+        if (!index.empty())
+            tmp.build_index();
+        swap(tmp);
+
+        return *this;
+    }
 
+    Set& operator=(Set &&other) {
+        swap(other);
         return *this;
     }
 
+    void swap(Set &other) {
+        std::swap(root, other.root);
+        std::swap(resource, other.resource);
+        std::swap(bulk_release, other.bulk_release);
+        undo.swap(other.undo);
+        std::swap(in_txn, other.in_txn);
+        std::swap(slack, other.slack);
+        std::swap(pending, other.pending);
+        std::swap(purge_ratio, other.purge_ratio);
+        std::swap(dead, other.dead);
+        cache.swap(other.cache);
+        std::swap(hits, other.hits);
+        std::swap(misses, other.misses);
+        index.swap(other.index);
+        std::swap(indexed, other.indexed);
+    }
+
+    // Relaxed balancing for bursty writes. With slack > 0, insert and erase
+    // outside a transaction only fix sizes on the way back up and leave the
+    // rotations for later. Each write then retires up to two of the nodes
+    // left stale, with the rotations an eager write would have done there,
+    // and more while over slack of them are stale; so no single write pays
+    // for the whole backlog, and sorted keys cannot build up a spine.
+    // settle() repairs the rest at once, e.g. when idle, as does anything
+    // else that restructures the tree.
+    void set_slack(size_t n) {
+        slack = n;
+        if (slack == 0)
+            settle();
+    }
+
+    size_t get_slack() const {
+        return slack;
+    }
+
+    // Lazy erase for bursts of deletions. With ratio > 0, erase outside a
+    // transaction only marks the node as a tombstone, which lookups,
+    // iteration, size() and rank skip, and inserting the key again revives
+    // it. Once tombstones make up ratio of the nodes, purge() rebuilds the
+    // tree from the live nodes in O(n); iterators to live keys stay valid.
+    void set_lazy_erase(double ratio) {
+        purge_ratio = ratio;
+        if (ratio <= 0)
+            purge();
+    }
+
+    double get_lazy_erase() const {
+        return purge_ratio;
+    }
+
+    void purge() {
+        if (dead == 0)
+            return;
+        std::vector<Node *> live;
+        live.reserve(size());
+        collect(root, live);
+        set_root(relink(live.data(), live.size()));
+        dead = 0;
+        pending = 0;
+        if (!index.empty())
+            reindex();
+    }
+
+    // Puts a direct-mapped cache of slots entries (rounded up to a power of
+    // two, 0 to turn it off) from key hash to node in front of find(), so
+    // a hot key costs one probe and one comparison instead of a descent.
+    // find() then writes to the set and must not run concurrently.
+    void set_cache(size_t slots) {
+        static_assert(is_hashable<ValueType>::value,
+                      "the lookup cache needs std::hash<ValueType>");
+        size_t n = 1;
+        while (n < slots)
+            n <<= 1;
+        cache.assign((slots ? n : 0), nullptr);
+        hits = misses = 0;
+    }
+
+    size_t cache_hits() const {
+        return hits;
+    }
+
+    size_t cache_misses() const {
+        return misses;
+    }
+
+    // Keeps a hash index from key to node next to the tree, so find() and
+    // contains() take O(1) expected time while lower_bound, rank and
+    // iteration stay on the tree. Slots take two words and the table is
+    // kept between 3/8 and 3/4 full as it grows, so about 2.7 to 5.3 words
+    // per key; it does not shrink on erase.
+    void set_hash_index(bool on) {
+        static_assert(is_hashable<ValueType>::value,
+                      "the hash index needs std::hash<ValueType>");
+        std::vector<Slot>().swap(index);
+        indexed = 0;
+        if (on)
+            build_index();
+    }
+
+    bool has_hash_index() const {
+        return !index.empty();
+    }
+
+    // Does the deferred rebalancing now, e.g. when the writer is idle.
+    void settle() {
+        if (pending == 0)
+            return;
+        set_root(repair(root));
+        pending = 0;
+    }
+
+    // Transactions do not nest. Rollback undoes the changes since
+    // begin_transaction() in time proportional to their number.
+    void begin_transaction() {
+        commit();
+        settle();
+        in_txn = true;
+    }
+
+    void commit() {
+        for (size_t i = 0; i < undo.size(); ++i) {
+            if (undo[i].kind == Undo::erased)
+                free_node(resource, undo[i].node);
+        }
+        undo.clear();
+        in_txn = false;
+    }
+
+    void rollback() {
+        in_txn = false;
+        // The index may have been turned on, and sized, since the erases.
+        size_t erased = 0;
+        for (const Undo& u : undo)
+            erased += (u.kind == Undo::erased ? 1 : 0);
+        index_reserve(indexed + erased);
+        while (!undo.empty()) {
+            Undo u = undo.back();
+            undo.pop_back();
+            Node *res = nullptr;
+            Node *tomb = nullptr;
+            if (u.kind == Undo::inserted) {
+                free_node(resource, unlink(u.node->key));
+            } else if (u.kind == Undo::revived) {
+                bury(u.node);
+            } else {
+                set_root(_link(root, u.node, res, tomb));
+                index_add(u.node);
+                if (u.node->dead)
+                    ++dead;
+            }
+        }
+    }
+
+    bool in_transaction() const {
+        return in_txn;
+    }
+
     iterator begin() const {
-        return iterator(get_left(root), root);
+        return iterator(first_live(root), root);
     }
 
     iterator end() const {
         return iterator(nullptr, root);
     }
 
-    void insert(const ValueType &val) {
-        root = _insert(root, val);
+    void insert(key_arg val) {
+        index_reserve(indexed + 1);
+        if (slack && !in_txn) {
+            insert_relaxed(val);
+            return;
+        }
+        Node *res = nullptr;
+        if (in_txn)
+            undo.reserve(undo.size() + 1);
+        size_t old_size = size();
+        size_t old_dead = dead;
+        set_root(_insert(root, Probe(val), res));
+        if (size() != old_size && dead == old_dead)
+            note_insert(res);
     }
 
-    void erase(const ValueType &val) {
-        root = _erase(root, val);
+    insert_return_type insert(node_type&& nh) {
+        if (nh.empty())
+            return {end(), false, node_type()};
+        settle();
+        Node *res = nullptr;
+        if (nh.resource != resource &&
+            (res = _find(root, Probe(nh.node->key))))
+            return {iterator(res, root), false, std::move(nh)};
+        if (in_txn)
+            undo.reserve(undo.size() + 2);
+        index_reserve(indexed + 1);
+        Node *X = nh.node;
+        nh.node = nullptr;
+        X = adopt(X, nh.resource);
+        static_cast<Prefix&>(*X) = Traits::make(X->key);
+        res = link(X);
+        if (res != X) {
+            nh.node = X;
+            return {iterator(res, root), false, std::move(nh)};
+        }
+        index_add(X);
+        note_insert(X);
+        return {iterator(res, root), true, node_type()};
     }
 
-    iterator find(const ValueType& val) const {
-        return iterator(_find(root, val), root);
+    void erase(key_arg val) {
+        if (purge_ratio > 0 && !in_txn) {
+            erase_lazy(val);
+            return;
+        }
+        if (slack && !in_txn) {
+            erase_relaxed(val);
+            return;
+        }
+        if (in_txn)
+            undo.reserve(undo.size() + 1);
+        discard(unlink(val));
     }
 
-    iterator lower_bound(const ValueType& val) const {
-        return iterator(_lower_bound(root, val), root);
+    node_type extract(key_arg val) {
+        return node_type(take(val), resource);
+    }
+
+    node_type extract(iterator pos) {
+        if (pos.cur == nullptr)
+            return node_type();
+        return node_type(take(pos.cur->key), resource);
+    }
+
+    void merge(Set &other) {
+        if (&other == this)
+            return;
+        settle();
+        Node *N = first_live(other.root);
+        while (N) {
+            Node *next = get_next(N);
+            if (!_find(root, Probe(N->key))) {
+                if (in_txn)
+                    undo.reserve(undo.size() + 2);
+                index_reserve(indexed + 1);
+                Node *X = adopt(other.take(N->key), other.resource);
+                link(X);
+                index_add(X);
+                note_insert(X);
+            }
+            N = next;
+        }
+    }
+
+    // Erases every key less than bound in O(log n) plus the cost of freeing
+    // the erased nodes, and returns how many there were.
+    size_t erase_before(key_arg bound) {
+        Node *L = nullptr;
+        Node *R = nullptr;
+        settle();
+        _split(root, Probe(bound), L, R);
+        set_root(R);
+        size_t erased = get_size(L);
+        if (dead)
+            dead -= count_dead(L);
+        std::fill(cache.begin(), cache.end(), nullptr);
+        if (!index.empty())
+            index_tree(L, false);
+        if (in_txn) {
+            undo.reserve(undo.size() + erased);
+            discard_tree(L);
+        } else if (!bulk_release ||
+                   !std::is_trivially_destructible<ValueType>::value) {
+            destroy(L);
+        }
+        return erased;
+    }
+
+    // Number of keys less than val.
+    size_t rank(key_arg val) const {
+        size_t res = 0;
+        Probe K(val);
+        Node *N = root;
+        while (N) {
+            if (compare(K, N) > 0) {
+                res += get_size(N->child[0]) + (N->dead ? 0 : 1);
+                N = N->child[1];
+            } else {
+                N = N->child[0];
+            }
+        }
+        return res;
+    }
+
+    // The k-th smallest key counting from zero, or end() if k >= size().
+    iterator nth(size_t k) const {
+        Node *N = root;
+        while (N) {
+            size_t left = get_size(N->child[0]);
+            if (k < left) {
+                N = N->child[0];
+            } else if (k == left && !N->dead) {
+                break;
+            } else {
+                k -= left + (N->dead ? 0 : 1);
+                N = N->child[1];
+            }
+        }
+        return iterator(N, root);
+    }
+
+    // Rank of the q-th quantile among n keys, with q clamped to [0, 1].
+    static size_t quantile_rank(double q, size_t n) {
+        if (n == 0)
+            return 0;
+        if (q < 0)
+            q = 0;
+        if (q > 1)
+            q = 1;
+        return static_cast<size_t>(q * static_cast<double>(n - 1));
+    }
+
+    iterator quantile(double q) const {
+        if (empty())
+            return end();
+        return nth(quantile_rank(q, size()));
+    }
+
+    // All requested quantiles, in the order given, from one shared descent.
+    std::vector<iterator> quantiles(const std::vector<double>& qs) const {
+        std::vector<iterator> res(qs.size(), end());
+        if (empty())
+            return res;
+        std::vector<std::pair<size_t, size_t> > order(qs.size());
+        for (size_t i = 0; i < qs.size(); ++i)
+            order[i] = std::make_pair(quantile_rank(qs[i], size()), i);
+        std::sort(order.begin(), order.end());
+        std::vector<size_t> ranks(qs.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            ranks[i] = order[i].first;
+        std::vector<Node *> found(qs.size(), nullptr);
+        _select(root, ranks.data(), ranks.size(), 0, found.data());
+        for (size_t i = 0; i < order.size(); ++i)
+            res[order[i].second] = iterator(found[i], root);
+        return res;
+    }
+
+    // Copy the k smallest keys in ascending order, or the k largest in
+    // descending order, to out in O(k + log n) without allocating.
+    template<typename OutIt>
+    OutIt bottom_k(size_t k, OutIt out) const {
+        Node *N = first_live(root);
+        while (N && k > 0) {
+            *out++ = N->key;
+            N = get_next(N);
+            --k;
+        }
+        return out;
+    }
+
+    template<typename OutIt>
+    OutIt top_k(size_t k, OutIt out) const {
+        Node *N = last_live(root);
+        while (N && k > 0) {
+            *out++ = N->key;
+            N = get_prev(N);
+            --k;
+        }
+        return out;
+    }
+
+    // Copies the first min(n, size()) keys in order to out in one walk of
+    // the tree, with no successor climbing, and returns how many it copied.
+    size_t copy_to(ValueType *out, size_t n) const {
+        size_t i = 0;
+        _copy(root, out, n, i);
+        return i;
+    }
+
+    std::vector<ValueType> to_vector() const {
+        std::vector<ValueType> res;
+        res.reserve(size());
+        auto put = [&](const ValueType& key) {
+            res.push_back(key);
+        };
+        walk(root, put);
+        return res;
+    }
+
+    // Streams the keys in order through a buffer of at most chunk keys,
+    // handing each full block to sink(const ValueType *keys, size_t n), so
+    // a set can go to a file or socket without a copy of the whole of it.
+    // A chunk of 0 is taken as 1.
+    template<typename Sink>
+    void export_chunks(size_t chunk, Sink sink) const {
+        const size_t limit = std::max<size_t>(chunk, 1);
+        std::vector<ValueType> buf;
+        buf.reserve(std::min(size(), limit));
+        auto put = [&](const ValueType& key) {
+            buf.push_back(key);
+            if (buf.size() == limit) {
+                sink(static_cast<const ValueType *>(buf.data()), buf.size());
+                buf.clear();
+            }
+        };
+        walk(root, put);
+        if (!buf.empty())
+            sink(static_cast<const ValueType *>(buf.data()), buf.size());
+    }
+
+    // Raw binary dump of a set of trivially copyable keys: the count, then
+    // the keys in order, written in blocks straight from a flat buffer.
+    void save(std::ostream &os) const {
+        static_assert(std::is_trivially_copyable<ValueType>::value,
+                      "save() needs trivially copyable keys");
+        uint64_t n = size();
+        os.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        export_chunks(4096, [&](const ValueType *keys, size_t count) {
+            os.write(reinterpret_cast<const char *>(keys),
+                     static_cast<std::streamsize>(count * sizeof(ValueType)));
+        });
+    }
+
+    // Replaces the contents with a dump made by save() and builds the tree
+    // in O(n). On a short or unsorted input the set is left unchanged and
+    // failbit is set.
+    void load(std::istream &is) {
+        static_assert(std::is_trivially_copyable<ValueType>::value,
+                      "load() needs trivially copyable keys");
+        uint64_t n = 0;
+        if (!is.read(reinterpret_cast<char *>(&n), sizeof(n)))
+            return;
+        std::vector<ValueType> keys;
+        const uint64_t block = 4096;
+        while (keys.size() < n) {
+            size_t have = keys.size();
+            keys.resize(have + static_cast<size_t>(std::min(block, n - have)));
+            is.read(reinterpret_cast<char *>(keys.data() + have),
+                    static_cast<std::streamsize>((keys.size() - have) *
+                                                 sizeof(ValueType)));
+            if (!is)
+                return;
+        }
+        for (size_t i = 1; i < keys.size(); ++i) {
+            if (!(keys[i - 1] < keys[i])) {
+                is.setstate(std::ios_base::failbit);
+                return;
+            }
+        }
+        Set tmp(resource);
+        tmp.slack = slack;
+        tmp.purge_ratio = purge_ratio;
+        tmp.cache.resize(cache.size());
+        auto start = keys.begin();
+        tmp.set_root(tmp.build(start, keys.size()));
+        if (!index.empty())
+            tmp.build_index();
+        swap(tmp);
+    }
+
+    iterator find(key_arg val) const {
+        if (!index.empty())
+            return iterator(index_find(val), root);
+        if (cache.empty())
+            return iterator(_find(root, Probe(val)), root);
+        Node *&slot = cache[cache_slot(val)];
+        Node *N = slot;
+        if (N && !N->dead && !(N->key < val) && !(val < N->key)) {
+            ++hits;
+            return iterator(N, root);
+        }
+        ++misses;
+        N = _find(root, Probe(val));
+        if (N)
+            slot = N;
+        return iterator(N, root);
+    }
+
+    // Verifies the whole structure in O(n), for tests and debugging: key
+    // order, parent links, sizes, heights, the hash index and tombstone
+    // count, and the policy's balance unless repairs or tombstones are
+    // outstanding.
+    bool check() const {
+        if (root && root->P)
+            return false;
+        size_t nodes = 0;
+        size_t tombs = 0;
+        size_t stales = 0;
+        if (!_check(root, nullptr, nullptr, pending == 0 && dead == 0,
+                    nodes, tombs, stales))
+            return false;
+        return tombs == dead && stales == pending &&
+               (index.empty() || indexed == nodes);
+    }
+
+    bool contains(key_arg val) const {
+        return find(val) != end();
+    }
+
+    iterator lower_bound(key_arg val) const {
+        Node *N = _lower_bound(root, Probe(val));
+        return iterator((N && N->dead ? get_next(N) : N), root);
+    }
+
+    // find and lower_bound for each of keys[0, n), written to out[0, n).
+    // The lookups are interleaved so their cache misses overlap, which pays
+    // off once the tree no longer fits in cache.
+    void find_batch(const ValueType *keys, size_t n, iterator *out) const {
+        _lookup_batch(root, keys, n, true, [&](size_t i, Node *N) {
+            out[i] = iterator(N, root);
+        });
+    }
+
+    void lower_bound_batch(const ValueType *keys, size_t n,
+                           iterator *out) const {
+        _lookup_batch(root, keys, n, false, [&](size_t i, Node *N) {
+            out[i] = iterator(N, root);
+        });
     }
 
     size_t size() const {
@@ -384,12 +2036,12 @@ class Set {
     }
 
     bool empty() const {
-        return (root == nullptr);
+        return (size() == 0);
     }
 
     ~Set() {
-        destroy(root);
-        root = nullptr;
+        commit();
+        destroy_all();
     }
 };
 
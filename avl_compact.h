@@ -0,0 +1,377 @@
+#ifndef AVL_COMPACT_H_
+#define AVL_COMPACT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <initializer_list>
+
+namespace avl {
+
+// AVL set whose nodes live in one contiguous pool and link to each other by
+// 32-bit indices instead of pointers. Index 0 is the null link and node i
+// is stored at pool[i - 1]; freed slots are chained through child[0] for
+// reuse.
+template<class ValueType>
+class CompactSet {
+ private:
+    typedef uint32_t index_t;
+
+    struct Node {
+        ValueType key;
+        index_t child[2];
+        index_t P;
+        index_t height;
+        index_t size;
+
+        explicit Node(ValueType key):
+        key(std::move(key)),
+        child{0, 0},
+        P(0),
+        height(1),
+        size(1) {}
+    };
+
+    std::vector<Node> pool;
+    index_t root;
+    index_t free_head;
+
+    Node& node(index_t N) {
+        return pool[N - 1];
+    }
+
+    const Node& node(index_t N) const {
+        return pool[N - 1];
+    }
+
+    index_t create_node(const ValueType& key) {
+        if (free_head) {
+            index_t N = free_head;
+            Node& n = node(N);
+            free_head = n.child[0];
+            n.key = key;
+            n.child[0] = n.child[1] = n.P = 0;
+            n.height = 1;
+            n.size = 1;
+            return N;
+        }
+        if (pool.size() >= UINT32_MAX)
+            throw std::length_error("avl::CompactSet: too many nodes");
+        pool.emplace_back(key);
+        return static_cast<index_t>(pool.size());
+    }
+
+    void free_node(index_t N) {
+        node(N).child[0] = free_head;
+        free_head = N;
+    }
+
+    index_t get_height(index_t N) const {
+        return (N ? node(N).height : 0);
+    }
+
+    index_t get_size(index_t N) const {
+        return (N ? node(N).size : 0);
+    }
+
+    void recalc_node(index_t N) {
+        if (!N)
+            return;
+        Node& n = node(N);
+        n.height = std::max(get_height(n.child[0]),
+                            get_height(n.child[1])) + 1;
+        n.size = get_size(n.child[0]) + get_size(n.child[1]) + 1;
+        for (int d = 0; d < 2; ++d) {
+            if (n.child[d])
+                node(n.child[d]).P = N;
+        }
+    }
+
+    // Same steps as tree_rotate and AvlBalance::fix in avl.h, over indices.
+    index_t rotate(index_t N, int d) {
+        index_t C = node(N).child[!d];
+        index_t T = node(C).child[d];
+
+        node(C).child[d] = N;
+        node(N).child[!d] = T;
+
+        node(C).P = node(N).P;
+
+        recalc_node(N);
+        recalc_node(C);
+
+        return C;
+    }
+
+    int get_balance(index_t N) const {
+        int left = static_cast<int>(get_height(node(N).child[0]));
+        int right = static_cast<int>(get_height(node(N).child[1]));
+        return left - right;
+    }
+
+    index_t rebalance(index_t N) {
+        recalc_node(N);
+
+        int bal = get_balance(N);
+
+        if (bal > 1 || bal < -1) {
+            int d = (bal < -1);  // heavy side
+            index_t C = node(N).child[d];
+            int inner = (d ? get_balance(C) > 0 : get_balance(C) < 0);
+            if (inner) {  // LR, RL
+                index_t R = rotate(C, d);
+                node(N).child[d] = R;
+            }
+            return rotate(N, !d);  // LL, RR
+        }
+
+        return N;
+    }
+
+    // create_node may grow the pool, so no Node reference is held across
+    // the recursive calls below.
+    index_t _insert(index_t N, const ValueType& key) {
+        if (!N)
+            return create_node(key);
+
+        int d;
+        if (key < node(N).key) {
+            d = 0;
+        } else if (node(N).key < key) {
+            d = 1;
+        } else {
+            return N;
+        }
+        index_t C = _insert(node(N).child[d], key);
+        node(N).child[d] = C;
+
+        return rebalance(N);
+    }
+
+    index_t _remove_min(index_t N, index_t &M) {
+        if (!node(N).child[0]) {
+            M = N;
+            return node(N).child[1];
+        }
+        index_t C = _remove_min(node(N).child[0], M);
+        node(N).child[0] = C;
+        return rebalance(N);
+    }
+
+    index_t _erase(index_t N, const ValueType& key, index_t &res) {
+        if (!N)
+            return 0;
+        if (key < node(N).key || node(N).key < key) {
+            int d = (node(N).key < key);
+            index_t C = _erase(node(N).child[d], key, res);
+            node(N).child[d] = C;
+        } else {
+            res = N;
+            index_t L = node(N).child[0];
+            index_t R = node(N).child[1];
+            if (!L || !R)
+                return (L ? L : R);
+            index_t M = 0;
+            R = _remove_min(R, M);
+            node(M).child[0] = L;
+            node(M).child[1] = R;
+            N = M;
+        }
+
+        return rebalance(N);
+    }
+
+    index_t _find(index_t N, const ValueType& key) const {
+        while (N) {
+            const Node& n = node(N);
+            if (key < n.key) {
+                N = n.child[0];
+            } else if (n.key < key) {
+                N = n.child[1];
+            } else {
+                return N;
+            }
+        }
+        return 0;
+    }
+
+    index_t _lower_bound(index_t N, const ValueType& key) const {
+        index_t res = 0;
+        while (N) {
+            const Node& n = node(N);
+            if (n.key < key) {
+                N = n.child[1];
+            } else {
+                res = N;
+                if (!(key < n.key))
+                    break;
+                N = n.child[0];
+            }
+        }
+        return res;
+    }
+
+    index_t get_last(index_t N, int d) const {
+        if (!N)
+            return 0;
+        while (node(N).child[d])
+            N = node(N).child[d];
+        return N;
+    }
+
+    index_t get_left(index_t N) const {
+        return get_last(N, 0);
+    }
+
+    index_t get_right(index_t N) const {
+        return get_last(N, 1);
+    }
+
+    // In-order neighbour of N in direction d.
+    index_t get_step(index_t N, int d) const {
+        if (!N)
+            return 0;
+        if (node(N).child[d])
+            return get_last(node(N).child[d], !d);
+        while (node(N).P) {
+            if (node(node(N).P).child[!d] == N) {
+                return node(N).P;
+            }
+            N = node(N).P;
+        }
+        return 0;
+    }
+
+    index_t get_next(index_t N) const {
+        return get_step(N, 1);
+    }
+
+    index_t get_prev(index_t N) const {
+        return get_step(N, 0);
+    }
+
+    void set_root(index_t N) {
+        root = N;
+        if (root)
+            node(root).P = 0;
+    }
+
+ public:
+    class iterator {
+     private:
+        const CompactSet *set;
+        index_t cur;
+
+     public:
+        iterator(): set(nullptr), cur(0) {}
+        iterator(const CompactSet *set, index_t N): set(set), cur(N) {}
+
+        iterator& operator++() {
+            cur = set->get_next(cur);
+            return *this;
+        }
+
+        iterator& operator--() {
+            if (cur == 0) {
+                cur = set->get_right(set->root);
+            } else {
+                cur = set->get_prev(cur);
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        iterator operator--(int) {
+            iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            return cur == other.cur;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return cur != other.cur;
+        }
+
+        const ValueType& operator*() const {
+            return set->node(cur).key;
+        }
+
+        const ValueType* operator->() const {
+            return &(set->node(cur).key);
+        }
+    };
+
+    CompactSet(): root(0), free_head(0) {}
+
+    template<typename Iter>
+    CompactSet(Iter start, Iter end): CompactSet() {
+        while (start != end) {
+            insert(*start);
+            ++start;
+        }
+    }
+
+    CompactSet(std::initializer_list<ValueType> elems):
+    CompactSet(elems.begin(), elems.end()) {}
+
+    iterator begin() const {
+        return iterator(this, get_left(root));
+    }
+
+    iterator end() const {
+        return iterator(this, 0);
+    }
+
+    void insert(const ValueType &val) {
+        set_root(_insert(root, val));
+    }
+
+    void erase(const ValueType &val) {
+        index_t res = 0;
+        set_root(_erase(root, val, res));
+        if (res)
+            free_node(res);
+    }
+
+    iterator find(const ValueType& val) const {
+        return iterator(this, _find(root, val));
+    }
+
+    iterator lower_bound(const ValueType& val) const {
+        return iterator(this, _lower_bound(root, val));
+    }
+
+    // Pre-sizes the pool so that inserting up to n keys never reallocates.
+    void reserve(size_t n) {
+        pool.reserve(n);
+    }
+
+    void clear() {
+        pool.clear();
+        root = 0;
+        free_head = 0;
+    }
+
+    size_t size() const {
+        return get_size(root);
+    }
+
+    bool empty() const {
+        return (root == 0);
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_COMPACT_H_
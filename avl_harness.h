@@ -0,0 +1,390 @@
+#ifndef AVL_HARNESS_H_
+#define AVL_HARNESS_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <iterator>
+#include <ostream>
+#include <random>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "avl.h"
+
+namespace avl {
+
+// Differential testing and per-operation timing for Set. A trace is a fixed
+// list of operations on integer keys. It can be saved as text and replayed,
+// so a wrong answer or a slowdown can be bisected on the same workload.
+enum TraceKind {
+    trace_insert,
+    trace_erase,
+    trace_find,
+    trace_lower_bound,
+    trace_rank,
+    trace_nth,
+    trace_erase_before,
+    trace_begin,
+    trace_commit,
+    trace_rollback,
+    trace_extract,
+    trace_reinsert,
+    trace_merge,
+    trace_config,
+    trace_kinds
+};
+
+struct TraceOp {
+    TraceKind kind;
+    int64_t key;
+};
+
+typedef std::vector<TraceOp> Trace;
+
+// Relative frequency of each kind in a random trace, in TraceKind order.
+struct TraceMix {
+    unsigned weight[trace_kinds] = {40, 25, 25, 4, 2, 2, 2,
+                                    1, 1, 1, 2, 2, 1, 1};
+};
+
+inline const char *trace_name(TraceKind kind) {
+    static const char *const names[trace_kinds] = {
+        "insert", "erase", "find", "lower_bound", "rank", "nth",
+        "erase_before", "begin", "commit", "rollback", "extract", "reinsert",
+        "merge", "config"
+    };
+    return names[kind];
+}
+
+// Keys are drawn uniformly from [0, key_range).
+inline Trace random_trace(size_t n, int64_t key_range, uint64_t seed,
+                          const TraceMix &mix = TraceMix()) {
+    std::mt19937_64 gen(seed);
+    std::discrete_distribution<int> pick(mix.weight, mix.weight + trace_kinds);
+    std::uniform_int_distribution<int64_t> key(0, key_range - 1);
+    Trace trace(n);
+    for (TraceOp &op : trace) {
+        op.kind = static_cast<TraceKind>(pick(gen));
+        op.key = key(gen);
+    }
+    return trace;
+}
+
+// One operation per line: a letter for its kind and the key. The letter is
+// the kind's first one, except for erase_before ('b'), begin ('t'),
+// rollback ('u') and reinsert ('p').
+inline void save_trace(std::ostream &os, const Trace &trace) {
+    static const char tags[trace_kinds + 1] = "ieflrnbtcuxpmo";
+    for (const TraceOp &op : trace)
+        os << tags[op.kind] << ' ' << op.key << '\n';
+}
+
+// Replaces trace with the one read up to the end of is. On a malformed
+// line trace is left unchanged and failbit is set.
+inline void load_trace(std::istream &is, Trace &trace) {
+    Trace res;
+    char tag = 0;
+    int64_t key = 0;
+    while (is >> tag) {
+        if (!(is >> key))
+            return;
+        TraceKind kind;
+        switch (tag) {
+        case 'i': kind = trace_insert; break;
+        case 'e': kind = trace_erase; break;
+        case 'f': kind = trace_find; break;
+        case 'l': kind = trace_lower_bound; break;
+        case 'r': kind = trace_rank; break;
+        case 'n': kind = trace_nth; break;
+        case 'b': kind = trace_erase_before; break;
+        case 't': kind = trace_begin; break;
+        case 'c': kind = trace_commit; break;
+        case 'u': kind = trace_rollback; break;
+        case 'x': kind = trace_extract; break;
+        case 'p': kind = trace_reinsert; break;
+        case 'm': kind = trace_merge; break;
+        case 'o': kind = trace_config; break;
+        default:
+            is.setstate(std::ios_base::failbit);
+            return;
+        }
+        res.push_back(TraceOp{kind, key});
+    }
+    if (is.bad())
+        return;
+    is.clear(is.rdstate() & ~std::ios_base::failbit);
+    trace.swap(res);
+}
+
+// What the transaction, node handle, merge and config kinds do with the key.
+// begin, commit and rollback ignore it. extract(key) keeps the node handle,
+// dropping any held before, and reinsert puts the held one back. merge
+// moves in key, key + 1 and key + 2 from a fresh set. config flips one
+// setting picked by key % 8: the cache, the hash index, relaxed mode or
+// lazy erase, off for an even pick and on for an odd one.
+template<class ValueType, class Balance>
+void configure(Set<ValueType, Balance> &set, int64_t key) {
+    switch ((key % 8 + 8) % 8) {
+    case 0: set.set_cache(0); break;
+    case 1: set.set_cache(64); break;
+    case 2: set.set_hash_index(false); break;
+    case 3: set.set_hash_index(true); break;
+    case 4: set.set_slack(0); break;
+    case 5: set.set_slack(7); break;
+    case 6: set.set_lazy_erase(0); break;
+    default: set.set_lazy_erase(0.3); break;
+    }
+}
+
+struct TraceResult {
+    bool ok;
+    size_t failed_at;  // index of the first bad operation, or the trace size
+    std::string error;
+};
+
+// Runs trace on set and on a std::set in lockstep, comparing every answer
+// and the sizes, and calling Set::check() every check_every operations and
+// at the end. The set may come preconfigured (relaxed mode, lazy erase,
+// cache, hash index) but should start out empty and outside a transaction.
+template<class ValueType, class Balance>
+TraceResult check_trace(const Trace &trace, Set<ValueType, Balance> &set,
+                        size_t check_every = 1024) {
+    static_assert(std::is_arithmetic<ValueType>::value,
+                  "traces hold integer keys");
+    std::vector<ValueType> start = set.to_vector();
+    std::set<ValueType> ref(start.begin(), start.end());
+    std::set<ValueType> saved;  // ref as of begin_transaction()
+    bool txn = false;
+    typename Set<ValueType, Balance>::node_type held;
+    auto fail = [&](size_t i, const std::string &what) {
+        return TraceResult{false, i, std::string(trace_name(trace[i].kind)) +
+                           "(" + std::to_string(trace[i].key) + "): " + what};
+    };
+    for (size_t i = 0; i < trace.size(); ++i) {
+        ValueType key = static_cast<ValueType>(trace[i].key);
+        switch (trace[i].kind) {
+        case trace_insert:
+            set.insert(key);
+            ref.insert(key);
+            break;
+        case trace_erase:
+            set.erase(key);
+            ref.erase(key);
+            break;
+        case trace_find: {
+            auto it = set.find(key);
+            if ((it != set.end()) != (ref.count(key) > 0) ||
+                (it != set.end() && *it != key))
+                return fail(i, "wrong result");
+            break;
+        }
+        case trace_lower_bound: {
+            auto it = set.lower_bound(key);
+            auto expect = ref.lower_bound(key);
+            if ((it == set.end()) != (expect == ref.end()) ||
+                (it != set.end() && *it != *expect))
+                return fail(i, "wrong result");
+            break;
+        }
+        case trace_rank: {
+            size_t expect = static_cast<size_t>(
+                std::distance(ref.begin(), ref.lower_bound(key)));
+            if (set.rank(key) != expect)
+                return fail(i, "wrong rank");
+            break;
+        }
+        case trace_nth: {
+            size_t k = static_cast<size_t>(trace[i].key) % (ref.size() + 1);
+            auto it = set.nth(k);
+            if (k == ref.size() ? it != set.end() :
+                it == set.end() || *it != *std::next(ref.begin(), k))
+                return fail(i, "wrong key");
+            break;
+        }
+        case trace_erase_before: {
+            auto last = ref.lower_bound(key);
+            size_t expect = static_cast<size_t>(
+                std::distance(ref.begin(), last));
+            ref.erase(ref.begin(), last);
+            if (set.erase_before(key) != expect)
+                return fail(i, "wrong count");
+            break;
+        }
+        case trace_begin:
+            set.begin_transaction();
+            saved = ref;
+            txn = true;
+            break;
+        case trace_commit:
+            set.commit();
+            txn = false;
+            break;
+        case trace_rollback:
+            set.rollback();
+            if (txn)
+                ref = saved;
+            txn = false;
+            break;
+        case trace_extract: {
+            held = set.extract(key);
+            bool expect = (ref.erase(key) > 0);
+            if (bool(held) != expect || (held && held.value() != key))
+                return fail(i, "wrong node");
+            break;
+        }
+        case trace_reinsert: {
+            bool had = bool(held);
+            ValueType k = (had ? held.value() : ValueType());
+            bool fresh = (had && ref.count(k) == 0);
+            auto res = set.insert(std::move(held));
+            if (res.inserted != fresh ||
+                (had && (res.position == set.end() || *res.position != k)))
+                return fail(i, "wrong result");
+            if (had && !fresh) {
+                if (!res.node || res.node.value() != k)
+                    return fail(i, "node not handed back");
+                held = std::move(res.node);
+            }
+            if (fresh)
+                ref.insert(k);
+            break;
+        }
+        case trace_merge: {
+            Set<ValueType, Balance> other;
+            std::vector<ValueType> left;
+            for (int j = 0; j < 3; ++j) {
+                ValueType k = static_cast<ValueType>(key + j);
+                other.insert(k);
+                if (!ref.insert(k).second)
+                    left.push_back(k);
+            }
+            set.merge(other);
+            if (other.to_vector() != left)
+                return fail(i, "wrong keys left behind");
+            break;
+        }
+        case trace_config:
+            configure(set, trace[i].key);
+            break;
+        default:
+            return fail(i, "unknown operation");
+        }
+        if (set.in_transaction() != txn)
+            return fail(i, "wrong transaction state");
+        if (set.size() != ref.size())
+            return fail(i, "size " + std::to_string(set.size()) +
+                        ", expected " + std::to_string(ref.size()));
+        if (check_every && (i + 1) % check_every == 0 && !set.check())
+            return fail(i, "invariant broken");
+    }
+    size_t n = trace.size();
+    if (!set.check())
+        return TraceResult{false, n, "invariant broken at the end"};
+    std::vector<ValueType> keys = set.to_vector();
+    if (!std::equal(keys.begin(), keys.end(), ref.begin(), ref.end()))
+        return TraceResult{false, n, "contents differ at the end"};
+    return TraceResult{true, n, std::string()};
+}
+
+struct TraceTiming {
+    size_t count[trace_kinds] = {};
+    double ns[trace_kinds] = {};
+
+    double ns_per_op(TraceKind kind) const {
+        return (count[kind] ? ns[kind] / static_cast<double>(count[kind]) : 0);
+    }
+};
+
+// Times each operation of trace on set alone. Every sample includes one
+// clock read, so compare timings with each other, not with other tools;
+// a merge also pays for filling its three-key source.
+template<class ValueType, class Balance>
+TraceTiming time_trace(const Trace &trace, Set<ValueType, Balance> &set) {
+    typedef std::chrono::steady_clock clock;
+    TraceTiming res;
+    typename Set<ValueType, Balance>::node_type held;
+    size_t sink = 0;
+    clock::time_point last = clock::now();
+    for (const TraceOp &op : trace) {
+        ValueType key = static_cast<ValueType>(op.key);
+        switch (op.kind) {
+        case trace_insert:
+            set.insert(key);
+            break;
+        case trace_erase:
+            set.erase(key);
+            break;
+        case trace_find:
+            sink += (set.find(key) != set.end());
+            break;
+        case trace_lower_bound:
+            sink += (set.lower_bound(key) != set.end());
+            break;
+        case trace_rank:
+            sink += set.rank(key);
+            break;
+        case trace_nth:
+            sink += (set.nth(static_cast<size_t>(op.key) % (set.size() + 1)) !=
+                     set.end());
+            break;
+        case trace_erase_before:
+            sink += set.erase_before(key);
+            break;
+        case trace_begin:
+            set.begin_transaction();
+            break;
+        case trace_commit:
+            set.commit();
+            break;
+        case trace_rollback:
+            set.rollback();
+            break;
+        case trace_extract:
+            held = set.extract(key);
+            break;
+        case trace_reinsert:
+            held = std::move(set.insert(std::move(held)).node);
+            break;
+        case trace_merge: {
+            Set<ValueType, Balance> other;
+            for (int j = 0; j < 3; ++j)
+                other.insert(static_cast<ValueType>(key + j));
+            set.merge(other);
+            break;
+        }
+        case trace_config:
+            configure(set, op.key);
+            break;
+        default:
+            break;
+        }
+        clock::time_point now = clock::now();
+        res.ns[op.kind] += std::chrono::duration<double, std::nano>(
+            now - last).count();
+        ++res.count[op.kind];
+        last = now;
+    }
+    // Keeps the lookups from being optimized away.
+    volatile size_t keep = sink;
+    (void)keep;
+    return res;
+}
+
+inline void print_timing(std::ostream &os, const TraceTiming &timing) {
+    for (int k = 0; k < trace_kinds; ++k) {
+        TraceKind kind = static_cast<TraceKind>(k);
+        if (timing.count[kind] == 0)
+            continue;
+        os << trace_name(kind) << ' ' << timing.ns_per_op(kind) << " ns/op ("
+           << timing.count[kind] << ")\n";
+    }
+}
+
+}  // namespace avl
+
+#endif  // AVL_HARNESS_H_
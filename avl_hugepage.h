@@ -0,0 +1,171 @@
+#ifndef AVL_HUGEPAGE_H_
+#define AVL_HUGEPAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <new>
+#include <memory_resource>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace avl {
+
+// Upstream resource backing memory with 2 MB pages. Each block is rounded up
+// to whole huge pages, so put a monotonic or pool resource with a large
+// initial buffer on top of it and give that to Set. It tries explicit
+// hugetlbfs pages first, then a 2 MB aligned mapping advised for transparent
+// huge pages, then plain pages; off Linux it forwards to new/delete.
+class HugePageResource : public std::pmr::memory_resource {
+ public:
+    enum Backing {
+        hugetlb,
+        transparent,
+        regular
+    };
+
+    static constexpr size_t page_size = size_t(2) << 20;
+
+    explicit HugePageResource(bool try_hugetlb = true):
+    try_hugetlb(try_hugetlb),
+    last(regular) {
+        bytes[hugetlb] = bytes[transparent] = bytes[regular] = 0;
+    }
+
+    HugePageResource(const HugePageResource&) = delete;
+    HugePageResource& operator=(const HugePageResource&) = delete;
+
+    // How the most recent block was obtained.
+    Backing last_backing() const {
+        return last;
+    }
+
+    // Bytes currently mapped with the given backing.
+    size_t mapped_bytes(Backing b) const {
+        return bytes[b];
+    }
+
+    // Bytes of the advised blocks the kernel has actually backed with
+    // transparent huge pages, read from /proc/self/smaps.
+    size_t transparent_huge_bytes() const {
+        size_t total = 0;
+#ifdef __linux__
+        FILE *f = std::fopen("/proc/self/smaps", "r");
+        if (!f)
+            return 0;
+        char line[256];
+        bool ours = false;
+        while (std::fgets(line, sizeof(line), f)) {
+            unsigned long start = 0, end = 0;
+            unsigned long kb = 0;
+            if (std::sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                ours = owns(start, end);
+            } else if (ours &&
+                       std::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+                total += size_t(kb) << 10;
+            }
+        }
+        std::fclose(f);
+#endif
+        return total;
+    }
+
+ private:
+    struct Block {
+        size_t size;
+        Backing backing;
+    };
+
+    bool try_hugetlb;
+    Backing last;
+    size_t bytes[3];
+    std::map<uintptr_t, Block> blocks;
+
+    bool owns(uintptr_t start, uintptr_t end) const {
+        auto it = blocks.upper_bound(start);
+        if (it == blocks.begin())
+            return false;
+        --it;
+        return it->second.backing == transparent &&
+               end <= it->first + it->second.size;
+    }
+
+#ifdef __linux__
+    void *map(size_t size, Backing &backing) {
+        void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (try_hugetlb) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                backing = hugetlb;
+                return p;
+            }
+        }
+#endif
+        // Over-map by one page and trim so the block starts on a 2 MB boundary.
+        size_t span = size + page_size;
+        p = mmap(nullptr, span, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        uintptr_t raw = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = (raw + page_size - 1) & ~(page_size - 1);
+        if (aligned > raw)
+            munmap(p, aligned - raw);
+        if (raw + span > aligned + size)
+            munmap(reinterpret_cast<void *>(aligned + size),
+                   raw + span - aligned - size);
+        p = reinterpret_cast<void *>(aligned);
+        backing = regular;
+#ifdef MADV_HUGEPAGE
+        if (madvise(p, size, MADV_HUGEPAGE) == 0)
+            backing = transparent;
+#endif
+        return p;
+    }
+#endif
+
+    void *do_allocate(size_t n, size_t alignment) override {
+#ifdef __linux__
+        if (alignment <= page_size) {
+            size_t size = (n + page_size - 1) & ~(page_size - 1);
+            Backing backing = regular;
+            void *p = map(size, backing);
+            if (!p)
+                throw std::bad_alloc();
+            blocks[reinterpret_cast<uintptr_t>(p)] = Block{size, backing};
+            bytes[backing] += size;
+            last = backing;
+            return p;
+        }
+#endif
+        last = regular;
+        return std::pmr::new_delete_resource()->allocate(n, alignment);
+    }
+
+    void do_deallocate(void *p, size_t n, size_t alignment) override {
+#ifdef __linux__
+        auto it = blocks.find(reinterpret_cast<uintptr_t>(p));
+        if (it != blocks.end()) {
+            munmap(p, it->second.size);
+            bytes[it->second.backing] -= it->second.size;
+            blocks.erase(it);
+            return;
+        }
+#endif
+        std::pmr::new_delete_resource()->deallocate(p, n, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other)
+        const noexcept override {
+        return this == &other;
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_HUGEPAGE_H_
@@ -0,0 +1,370 @@
+#ifndef AVL_INTRUSIVE_H_
+#define AVL_INTRUSIVE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+#include "avl.h"
+
+namespace avl {
+
+// The links of Set's node, embedded in the caller's object. Height 0 marks
+// a hook that is in no set; linked hooks are at least 1. Copying an object
+// does not copy its membership.
+struct Hook {
+    Hook *child[2];
+    Hook *P;
+    uint32_t height;
+    size_t size;
+
+    Hook():
+    child{nullptr, nullptr},
+    P(nullptr),
+    height(0),
+    size(0) {}
+
+    Hook(const Hook&): Hook() {}
+
+    Hook& operator=(const Hook&) {
+        return *this;
+    }
+
+    bool is_linked() const {
+        return height != 0;
+    }
+};
+
+// Links caller-owned objects through their embedded Hook member. The set
+// never allocates and never owns the objects: they must outlive their
+// membership, and an object can sit in as many sets as it has hooks.
+template<class ValueType, Hook ValueType::*member>
+class IntrusiveSet {
+ private:
+    Hook *root;
+
+    // Distance from an object to its hook. A member pointer only yields it
+    // given a real object, so it is taken from each one inserted; the set
+    // holds no hooks before the first.
+    ptrdiff_t offset;
+
+    static Hook *hook(ValueType &x) {
+        return &(x.*member);
+    }
+
+    static ptrdiff_t offset_of(ValueType &x) {
+        return reinterpret_cast<char *>(hook(x)) -
+               reinterpret_cast<char *>(&x);
+    }
+
+    static ValueType *value(Hook *H, ptrdiff_t offset) {
+        return reinterpret_cast<ValueType *>(
+            reinterpret_cast<char *>(H) - offset);
+    }
+
+    const ValueType& key(Hook *H) const {
+        return *value(H, offset);
+    }
+
+    static size_t get_height(const Hook *N) {
+        return (N ? N->height : 0);
+    }
+
+    static size_t get_size(const Hook *N) {
+        return (N ? N->size : 0);
+    }
+
+    static void recalc_node(Hook *N) {
+        if (!N)
+            return;
+        N->height = std::max(get_height(N->child[0]),
+                             get_height(N->child[1])) + 1;
+        N->size = get_size(N->child[0]) + get_size(N->child[1]) + 1;
+        recalc_par(N);
+    }
+
+    static void recalc_par(Hook *N) {
+        if (!N)
+            return;
+        if (N->child[0]) {
+            N->child[0]->P = N;
+        }
+        if (N->child[1]) {
+            N->child[1]->P = N;
+        }
+    }
+
+    static Hook *rotate(Hook *N, int d) {
+        return tree_rotate(N, d, &recalc_node);
+    }
+
+    static Hook *rebalance(Hook *N) {
+        recalc_node(N);
+        return AvlBalance::fix(N, &rotate);
+    }
+
+    Hook *_link(Hook *N, Hook *X, Hook *&res) const {
+        if (!N) {
+            res = X;
+            return X;
+        }
+
+        int d;
+        if (key(X) < key(N)) {
+            d = 0;
+        } else if (key(N) < key(X)) {
+            d = 1;
+        } else {
+            res = N;
+            return N;
+        }
+        N->child[d] = _link(N->child[d], X, res);
+
+        return rebalance(N);
+    }
+
+    static Hook *get_left(Hook *N) {
+        return tree_last(N, 0);
+    }
+
+    static Hook *get_right(Hook *N) {
+        return tree_last(N, 1);
+    }
+
+    static Hook *get_next(Hook *N) {
+        return tree_step(N, 1);
+    }
+
+    static Hook *get_prev(Hook *N) {
+        return tree_step(N, 0);
+    }
+
+    static Hook *_remove_min(Hook *N, Hook *&M) {
+        if (!(N->child[0])) {
+            M = N;
+            return N->child[1];
+        }
+        N->child[0] = _remove_min(N->child[0], M);
+        return rebalance(N);
+    }
+
+    // Unlinks X only; an equal key held by another object is left alone.
+    Hook *_unlink(Hook *N, Hook *X, bool &found) const {
+        if (!N)
+            return nullptr;
+        if (key(X) < key(N)) {
+            N->child[0] = _unlink(N->child[0], X, found);
+        } else if (key(N) < key(X)) {
+            N->child[1] = _unlink(N->child[1], X, found);
+        } else {
+            if (N != X)
+                return N;
+            found = true;
+            if (!(N->child[0]) || !(N->child[1]))
+                return (N->child[0] ? N->child[0] : N->child[1]);
+            Hook *M = nullptr;
+            Hook *R = _remove_min(N->child[1], M);
+            M->child[0] = N->child[0];
+            M->child[1] = R;
+            N = M;
+        }
+
+        return rebalance(N);
+    }
+
+    Hook *_find(Hook *N, const ValueType& x) const {
+        if (!N) {
+            return nullptr;
+        }
+        if (x < key(N)) {
+            return _find(N->child[0], x);
+        } else if (key(N) < x) {
+            return _find(N->child[1], x);
+        } else {
+            return N;
+        }
+    }
+
+    Hook *_lower_bound(Hook *N, const ValueType& x) const {
+        if (!N)
+            return nullptr;
+        if (!(x < key(N)) && !(key(N) < x))
+            return N;
+        if (x < key(N)) {
+            Hook *res = _lower_bound(N->child[0], x);
+            if (!res)
+                res = N;
+            return res;
+        }
+        return _lower_bound(N->child[1], x);
+    }
+
+    static void reset_node(Hook *N) {
+        N->child[0] = N->child[1] = N->P = nullptr;
+        N->height = 1;
+        N->size = 1;
+    }
+
+    static void unlink_node(Hook *N) {
+        N->child[0] = N->child[1] = N->P = nullptr;
+        N->height = 0;
+        N->size = 0;
+    }
+
+    static void unlink_all(Hook *N) {
+        if (!N)
+            return;
+        unlink_all(N->child[0]);
+        unlink_all(N->child[1]);
+        unlink_node(N);
+    }
+
+    void set_root(Hook *N) {
+        root = N;
+        if (root)
+            root->P = nullptr;
+    }
+
+ public:
+    class iterator {
+     private:
+        Hook *cur;
+        Hook *root;
+        ptrdiff_t offset;
+
+        friend class IntrusiveSet;
+
+     public:
+        iterator(): cur(nullptr), root(nullptr), offset(0) {}
+        iterator(Hook *N, Hook *root, ptrdiff_t offset):
+        cur(N),
+        root(root),
+        offset(offset) {}
+
+        iterator& operator++() {
+            cur = get_next(cur);
+            return *this;
+        }
+
+        iterator& operator--() {
+            if (cur == nullptr) {
+                cur = get_right(root);
+            } else {
+                cur = get_prev(cur);
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        iterator operator--(int) {
+            iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            return cur == other.cur;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return cur != other.cur;
+        }
+
+        ValueType& operator*() const {
+            return *value(cur, offset);
+        }
+
+        ValueType* operator->() const {
+            return value(cur, offset);
+        }
+    };
+
+    IntrusiveSet(): root(nullptr), offset(0) {}
+
+    IntrusiveSet(const IntrusiveSet&) = delete;
+    IntrusiveSet& operator=(const IntrusiveSet&) = delete;
+
+    IntrusiveSet(IntrusiveSet&& other): root(other.root), offset(other.offset) {
+        other.root = nullptr;
+    }
+
+    IntrusiveSet& operator=(IntrusiveSet&& other) {
+        std::swap(root, other.root);
+        std::swap(offset, other.offset);
+        return *this;
+    }
+
+    ~IntrusiveSet() {
+        clear();
+    }
+
+    iterator begin() const {
+        return iterator(get_left(root), root, offset);
+    }
+
+    iterator end() const {
+        return iterator(nullptr, root, offset);
+    }
+
+    // Returns false and leaves x alone if it is already linked through
+    // this hook, or unlinked if an equal object is present.
+    bool insert(ValueType &x) {
+        Hook *X = hook(x);
+        if (X->is_linked())
+            return false;
+        offset = offset_of(x);
+        reset_node(X);
+        Hook *res = nullptr;
+        set_root(_link(root, X, res));
+        if (res != X)
+            unlink_node(X);
+        return (res == X);
+    }
+
+    bool erase(ValueType &x) {
+        Hook *X = hook(x);
+        if (!X->is_linked())
+            return false;
+        bool found = false;
+        set_root(_unlink(root, X, found));
+        if (found)
+            unlink_node(X);
+        return found;
+    }
+
+    iterator find(const ValueType& x) const {
+        return iterator(_find(root, x), root, offset);
+    }
+
+    iterator lower_bound(const ValueType& x) const {
+        return iterator(_lower_bound(root, x), root, offset);
+    }
+
+    iterator iterator_to(ValueType &x) const {
+        return iterator(hook(x), root, offset_of(x));
+    }
+
+    size_t size() const {
+        return get_size(root);
+    }
+
+    bool empty() const {
+        return (root == nullptr);
+    }
+
+    // Unlinks every object, leaving their hooks free for another insert.
+    void clear() {
+        unlink_all(root);
+        root = nullptr;
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_INTRUSIVE_H_
@@ -0,0 +1,159 @@
+#ifndef AVL_MERGE_H_
+#define AVL_MERGE_H_
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace avl {
+
+// Ordered view over several sets at once, e.g. one per shard or time
+// bucket, without copying them anywhere. The iterator runs a loser tree
+// over the sets' own iterators, so each step costs O(log k) comparisons for
+// k sets. With dedup, a key held by several sets comes out once; otherwise
+// once per set, in set order. The sets must outlive the view and stay
+// unchanged while it is iterated.
+template<class SetType>
+class MergeView {
+ private:
+    typedef typename SetType::iterator source_iterator;
+
+    std::vector<const SetType *> sets;
+    bool dedup;
+
+ public:
+    typedef typename std::decay<
+        decltype(*std::declval<source_iterator>())>::type value_type;
+
+    class iterator {
+     private:
+        struct Source {
+            source_iterator cur;
+            source_iterator end;
+        };
+
+        std::vector<Source> src;
+        // tree[0] is the current winner, tree[1, k) the loser of each match.
+        std::vector<size_t> tree;
+        bool dedup;
+
+        friend class MergeView;
+
+        bool done(size_t s) const {
+            return src[s].cur == src[s].end;
+        }
+
+        // Exhausted sources lose to everything; ties go to the lower set.
+        bool beats(size_t a, size_t b) const {
+            if (done(a))
+                return false;
+            if (done(b))
+                return true;
+            if (*src[a].cur < *src[b].cur)
+                return true;
+            return !(*src[b].cur < *src[a].cur) && a < b;
+        }
+
+        // Winner of the subtree at node, recording the losers below it.
+        size_t play(size_t node) {
+            size_t k = src.size();
+            if (node >= k)
+                return node - k;
+            size_t a = play(2 * node);
+            size_t b = play(2 * node + 1);
+            if (beats(b, a))
+                std::swap(a, b);
+            tree[node] = b;
+            return a;
+        }
+
+        void replay(size_t s) {
+            size_t w = s;
+            for (size_t node = (s + src.size()) / 2; node > 0; node /= 2) {
+                if (beats(tree[node], w))
+                    std::swap(tree[node], w);
+            }
+            tree[0] = w;
+        }
+
+        iterator(const std::vector<const SetType *> &sets, bool dedup):
+        src(sets.size()),
+        tree(sets.size(), 0),
+        dedup(dedup) {
+            for (size_t i = 0; i < sets.size(); ++i)
+                src[i] = Source{sets[i]->begin(), sets[i]->end()};
+            if (!src.empty())
+                tree[0] = play(1);
+        }
+
+     public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename MergeView::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        iterator(): dedup(false) {}
+
+        bool at_end() const {
+            return src.empty() || done(tree[0]);
+        }
+
+        iterator& operator++() {
+            size_t s = tree[0];
+            // A copy, not a reference: a RadixSet iterator owns its key.
+            source_iterator last = src[s].cur;
+            ++src[s].cur;
+            replay(s);
+            while (dedup && !at_end() && !(*last < **this)) {
+                s = tree[0];
+                ++src[s].cur;
+                replay(s);
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            if (at_end() || other.at_end())
+                return at_end() == other.at_end();
+            return tree[0] == other.tree[0] &&
+                   src[tree[0]].cur == other.src[other.tree[0]].cur;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return !(*this == other);
+        }
+
+        const value_type& operator*() const {
+            return *src[tree[0]].cur;
+        }
+
+        const value_type* operator->() const {
+            return &(**this);
+        }
+    };
+
+    explicit MergeView(std::vector<const SetType *> sets, bool dedup = false):
+    sets(std::move(sets)),
+    dedup(dedup) {}
+
+    iterator begin() const {
+        return iterator(sets, dedup);
+    }
+
+    iterator end() const {
+        return iterator();
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_MERGE_H_
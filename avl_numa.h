@@ -0,0 +1,166 @@
+#ifndef AVL_NUMA_H_
+#define AVL_NUMA_H_
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#ifdef AVL_USE_LIBNUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+namespace avl {
+
+// Upstream resource placing memory on NUMA nodes through libnuma when built
+// with AVL_USE_LIBNUMA (and linked with -lnuma). It hands out page-granular
+// blocks, so put a monotonic or pool resource on top of it and give that to
+// Set. Without libnuma, or on a machine without NUMA, it forwards to the
+// upstream resource.
+class NumaResource : public std::pmr::memory_resource {
+ public:
+    enum Policy {
+        interleave,
+        bind,
+        local
+    };
+
+    explicit NumaResource(Policy policy = interleave, int node = 0,
+                          std::pmr::memory_resource *upstream =
+                              std::pmr::new_delete_resource()):
+    policy(policy),
+    node(node),
+    upstream(upstream) {}
+
+    static bool available() {
+#ifdef AVL_USE_LIBNUMA
+        return numa_available() >= 0;
+#else
+        return false;
+#endif
+    }
+
+    static int nodes() {
+#ifdef AVL_USE_LIBNUMA
+        if (available())
+            return numa_max_node() + 1;
+#endif
+        return 1;
+    }
+
+    static bool has_node(int node) {
+#ifdef AVL_USE_LIBNUMA
+        if (available())
+            return numa_bitmask_isbitset(numa_all_nodes_ptr, node);
+#endif
+        return node == 0;
+    }
+
+    static int current_node() {
+#ifdef AVL_USE_LIBNUMA
+        if (available()) {
+            int cpu = sched_getcpu();
+            if (cpu >= 0)
+                return numa_node_of_cpu(cpu);
+        }
+#endif
+        return 0;
+    }
+
+ private:
+    Policy policy;
+    int node;
+    std::pmr::memory_resource *upstream;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+#ifdef AVL_USE_LIBNUMA
+        if (available()) {
+            void *p = nullptr;
+            if (policy == interleave) {
+                p = numa_alloc_interleaved(bytes);
+            } else if (policy == bind) {
+                p = numa_alloc_onnode(bytes, node);
+            } else {
+                p = numa_alloc_local(bytes);
+            }
+            if (!p)
+                throw std::bad_alloc();
+            return p;
+        }
+#endif
+        return upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+#ifdef AVL_USE_LIBNUMA
+        if (available()) {
+            numa_free(p, bytes);
+            return;
+        }
+#endif
+        upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other)
+        const noexcept override {
+        return this == &other;
+    }
+};
+
+// One read-only copy of a set per NUMA node, each built from memory bound
+// to its node, so lookups never leave the socket of the calling thread.
+template<class SetType>
+class NumaReplicas {
+ private:
+    struct Replica {
+        NumaResource upstream;
+        std::pmr::monotonic_buffer_resource arena;
+        SetType set;
+
+        Replica(int node, const SetType& source):
+        upstream(NumaResource::bind, node),
+        arena(1 << 20, &upstream),
+        set(&arena) {
+            for (const auto& key : source)
+                set.insert(key);
+        }
+    };
+
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::vector<Replica *> by_node;
+
+ public:
+    explicit NumaReplicas(const SetType& source) {
+        int n = NumaResource::nodes();
+        by_node.assign(static_cast<size_t>(n), nullptr);
+        for (int i = 0; i < n; ++i) {
+            if (!NumaResource::has_node(i))
+                continue;
+            replicas.emplace_back(new Replica(i, source));
+            by_node[static_cast<size_t>(i)] = replicas.back().get();
+        }
+    }
+
+    const SetType& local() const {
+        return on_node(NumaResource::current_node());
+    }
+
+    // Nodes without a replica (offline or memoryless) fall back to the
+    // first one.
+    const SetType& on_node(int node) const {
+        size_t i = static_cast<size_t>(node);
+        if (node < 0 || i >= by_node.size() || !by_node[i])
+            return replicas.front()->set;
+        return by_node[i]->set;
+    }
+
+    size_t count() const {
+        return replicas.size();
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_NUMA_H_
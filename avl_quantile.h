@@ -0,0 +1,108 @@
+#ifndef AVL_QUANTILE_H_
+#define AVL_QUANTILE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "avl.h"
+
+namespace avl {
+
+// Set that keeps an iterator on each requested quantile. Every insert or
+// erase moves each iterator by at most one step instead of re-descending,
+// which relies on erase leaving the other nodes in place.
+template<class ValueType>
+class QuantileTracker {
+ public:
+    typedef typename Set<ValueType>::iterator iterator;
+
+ private:
+    struct Mark {
+        double q;
+        size_t rank;
+        iterator it;
+    };
+
+    Set<ValueType> keys;
+    std::vector<Mark> marks;
+
+    void settle(Mark &m) {
+        if (keys.empty()) {
+            m.rank = 0;
+            m.it = keys.end();
+            return;
+        }
+        size_t target = Set<ValueType>::quantile_rank(m.q, keys.size());
+        while (m.rank < target) {
+            ++m.it;
+            ++m.rank;
+        }
+        while (m.rank > target) {
+            --m.it;
+            --m.rank;
+        }
+    }
+
+ public:
+    explicit QuantileTracker(const std::vector<double>& qs) {
+        for (size_t i = 0; i < qs.size(); ++i)
+            marks.push_back({qs[i], 0, keys.end()});
+    }
+
+    void insert(const ValueType& val) {
+        size_t old_size = keys.size();
+        keys.insert(val);
+        if (keys.size() == old_size)
+            return;
+        for (size_t i = 0; i < marks.size(); ++i) {
+            Mark &m = marks[i];
+            if (old_size == 0) {
+                m.it = keys.begin();
+            } else if (val < *m.it) {
+                ++m.rank;
+            }
+            settle(m);
+        }
+    }
+
+    void erase(const ValueType& val) {
+        iterator pos = keys.find(val);
+        if (pos == keys.end())
+            return;
+        for (size_t i = 0; i < marks.size(); ++i) {
+            Mark &m = marks[i];
+            if (m.it == pos) {
+                iterator next = pos;
+                ++next;
+                if (next != keys.end()) {
+                    m.it = next;
+                } else if (m.rank > 0) {
+                    --m.it;
+                    --m.rank;
+                }
+            } else if (val < *m.it) {
+                --m.rank;
+            }
+        }
+        keys.erase(val);
+        for (size_t i = 0; i < marks.size(); ++i)
+            settle(marks[i]);
+    }
+
+    // Iterator on the i-th requested quantile, or end() while empty.
+    iterator value(size_t i) const {
+        return marks[i].it;
+    }
+
+    const Set<ValueType>& set() const {
+        return keys;
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_QUANTILE_H_
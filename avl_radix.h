@@ -0,0 +1,528 @@
+#ifndef AVL_RADIX_H_
+#define AVL_RADIX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <initializer_list>
+
+#include "avl.h"
+
+namespace avl {
+
+// Set of byte strings stored in an adaptive radix tree with path
+// compression, behind the same interface as Set<std::string>. Lookups cost
+// O(key length) whatever the number of keys. Inner nodes keep up to 4 or 16
+// children in sorted arrays and switch to a direct 256-entry table beyond
+// that. Keys are not stored whole: an iterator spells out its key from
+// the path when it moves, so * refers into the iterator, and stays valid
+// until the iterator moves or its own key is erased.
+class RadixSet {
+ private:
+    struct Node {
+        std::string prefix;
+        Node *parent;
+        unsigned char byte;
+        bool terminal;
+        uint16_t count;
+        uint16_t cap;
+        unsigned char *bytes;
+        Node **kids;
+
+        Node():
+        parent(nullptr),
+        byte(0),
+        terminal(false),
+        count(0),
+        cap(0),
+        bytes(nullptr),
+        kids(nullptr) {}
+
+        ~Node() {
+            delete[] bytes;
+            delete[] kids;
+        }
+    } *root;
+
+    size_t count;
+
+    static constexpr uint16_t direct = 256;
+
+    static size_t slot(const Node *N, unsigned char b) {
+        size_t i = 0;
+        while (i < N->count && N->bytes[i] < b)
+            ++i;
+        return i;
+    }
+
+    static Node *child(const Node *N, unsigned char b) {
+        if (N->cap == direct)
+            return N->kids[b];
+        size_t i = slot(N, b);
+        return (i < N->count && N->bytes[i] == b ? N->kids[i] : nullptr);
+    }
+
+    // First child whose byte is at least from, for from in [0, 256].
+    static Node *child_from(const Node *N, unsigned from) {
+        if (N->cap == direct) {
+            for (unsigned b = from; b < direct; ++b) {
+                if (N->kids[b])
+                    return N->kids[b];
+            }
+            return nullptr;
+        }
+        for (size_t i = 0; i < N->count; ++i) {
+            if (N->bytes[i] >= from)
+                return N->kids[i];
+        }
+        return nullptr;
+    }
+
+    // Last child whose byte is less than to, for to in [0, 256].
+    static Node *child_before(const Node *N, unsigned to) {
+        if (N->cap == direct) {
+            for (unsigned b = to; b > 0; --b) {
+                if (N->kids[b - 1])
+                    return N->kids[b - 1];
+            }
+            return nullptr;
+        }
+        for (size_t i = N->count; i > 0; --i) {
+            if (N->bytes[i - 1] < to)
+                return N->kids[i - 1];
+        }
+        return nullptr;
+    }
+
+    static void resize(Node *N, uint16_t cap) {
+        unsigned char *bytes = nullptr;
+        Node **kids = new Node *[cap]();
+        if (cap != direct)
+            bytes = new unsigned char[cap];
+        size_t j = 0;
+        for (unsigned b = 0; b < direct && j < N->count; ++b) {
+            Node *C = (N->cap == direct ? N->kids[b] : nullptr);
+            if (N->cap != direct) {
+                if (N->bytes[j] != b)
+                    continue;
+                C = N->kids[j];
+            }
+            if (!C)
+                continue;
+            if (cap == direct) {
+                kids[b] = C;
+            } else {
+                bytes[j] = static_cast<unsigned char>(b);
+                kids[j] = C;
+            }
+            ++j;
+        }
+        delete[] N->bytes;
+        delete[] N->kids;
+        N->bytes = bytes;
+        N->kids = kids;
+        N->cap = cap;
+    }
+
+    static void add_child(Node *N, unsigned char b, Node *C) {
+        if (N->count == N->cap)
+            resize(N, (N->cap == 0 ? 4 : (N->cap == 4 ? 16 : direct)));
+        C->parent = N;
+        C->byte = b;
+        if (N->cap == direct) {
+            N->kids[b] = C;
+        } else {
+            size_t i = slot(N, b);
+            for (size_t j = N->count; j > i; --j) {
+                N->bytes[j] = N->bytes[j - 1];
+                N->kids[j] = N->kids[j - 1];
+            }
+            N->bytes[i] = b;
+            N->kids[i] = C;
+        }
+        ++N->count;
+    }
+
+    static void remove_child(Node *N, unsigned char b) {
+        if (N->cap == direct) {
+            N->kids[b] = nullptr;
+        } else {
+            size_t i = slot(N, b);
+            for (size_t j = i + 1; j < N->count; ++j) {
+                N->bytes[j - 1] = N->bytes[j];
+                N->kids[j - 1] = N->kids[j];
+            }
+        }
+        --N->count;
+        if (N->cap == direct && N->count <= 12)
+            resize(N, 16);
+    }
+
+    static void replace_child(Node *N, unsigned char b, Node *C) {
+        C->parent = N;
+        C->byte = b;
+        if (N->cap == direct) {
+            N->kids[b] = C;
+        } else {
+            N->kids[slot(N, b)] = C;
+        }
+    }
+
+    // The key spelled by the path from the root down to N.
+    static std::string key_of(const Node *N) {
+        size_t n = 0;
+        for (const Node *M = N; M; M = M->parent)
+            n += M->prefix.size() + (M->parent ? 1 : 0);
+        std::string key(n, '\0');
+        for (const Node *M = N; M; M = M->parent) {
+            n -= M->prefix.size();
+            key.replace(n, M->prefix.size(), M->prefix);
+            if (M->parent)
+                key[--n] = static_cast<char>(M->byte);
+        }
+        return key;
+    }
+
+    static Node *leftmost(Node *N) {
+        while (N && !N->terminal)
+            N = child_from(N, 0);
+        return N;
+    }
+
+    static Node *rightmost(Node *N) {
+        while (N->count)
+            N = child_before(N, direct);
+        return (N->terminal ? N : nullptr);
+    }
+
+    // First key after everything stored below N.
+    static Node *after(Node *N) {
+        while (N->parent) {
+            Node *C = child_from(N->parent, N->byte + 1u);
+            if (C)
+                return leftmost(C);
+            N = N->parent;
+        }
+        return nullptr;
+    }
+
+    static Node *get_next(Node *N) {
+        if (!N)
+            return nullptr;
+        if (N->count)
+            return leftmost(child_from(N, 0));
+        return after(N);
+    }
+
+    static Node *get_prev(Node *N) {
+        if (!N)
+            return nullptr;
+        while (N->parent) {
+            Node *P = N->parent;
+            Node *C = child_before(P, N->byte);
+            if (C)
+                return rightmost(C);
+            if (P->terminal)
+                return P;
+            N = P;
+        }
+        return nullptr;
+    }
+
+    Node *_find(const std::string& key) const {
+        Node *N = root;
+        size_t pos = 0;
+        while (N) {
+            const std::string& p = N->prefix;
+            if (key.compare(pos, p.size(), p) != 0)
+                return nullptr;
+            pos += p.size();
+            if (pos == key.size())
+                return (N->terminal ? N : nullptr);
+            N = child(N, static_cast<unsigned char>(key[pos]));
+            ++pos;
+        }
+        return nullptr;
+    }
+
+    Node *_lower_bound(const std::string& key) const {
+        Node *N = root;
+        size_t pos = 0;
+        while (true) {
+            const std::string& p = N->prefix;
+            size_t i = 0;
+            while (i < p.size() && pos + i < key.size() && p[i] == key[pos + i])
+                ++i;
+            if (i < p.size()) {
+                if (pos + i == key.size() ||
+                    static_cast<unsigned char>(key[pos + i]) <
+                    static_cast<unsigned char>(p[i]))
+                    return leftmost(N);
+                return after(N);
+            }
+            pos += p.size();
+            if (pos == key.size())
+                return leftmost(N);
+            unsigned char b = static_cast<unsigned char>(key[pos]);
+            Node *C = child(N, b);
+            if (!C) {
+                C = child_from(N, b + 1u);
+                return (C ? leftmost(C) : after(N));
+            }
+            N = C;
+            ++pos;
+        }
+    }
+
+    // Puts a new node holding p[0, m) between N and its parent.
+    static Node *split(Node *N, size_t m) {
+        Node *M = new Node();
+        M->prefix = N->prefix.substr(0, m);
+        replace_child(N->parent, N->byte, M);
+        unsigned char b = static_cast<unsigned char>(N->prefix[m]);
+        N->prefix.erase(0, m + 1);
+        add_child(M, b, N);
+        return M;
+    }
+
+    // Splices a non-terminal inner node with a single child out of the path.
+    static void compress(Node *N) {
+        if (!N->parent || N->terminal || N->count != 1)
+            return;
+        Node *C = child_from(N, 0);
+        C->prefix = N->prefix + static_cast<char>(C->byte) + C->prefix;
+        replace_child(N->parent, N->byte, C);
+        delete N;
+    }
+
+    static void destroy(Node *N) {
+        if (!N)
+            return;
+        size_t n = (N->cap == direct ? direct : N->count);
+        for (size_t i = 0; i < n; ++i)
+            destroy(N->kids[i]);
+        delete N;
+    }
+
+    static Node *clone(const Node *N) {
+        Node *M = new Node();
+        M->prefix = N->prefix;
+        M->terminal = N->terminal;
+        try {
+            for (Node *C = child_from(N, 0); C; C = child_from(N, C->byte + 1u))
+                add_child(M, C->byte, clone(C));
+        } catch (...) {
+            destroy(M);
+            throw;
+        }
+        return M;
+    }
+
+ public:
+    class iterator {
+     private:
+        Node *cur;
+        Node *root;
+        std::string key;
+
+        friend class RadixSet;
+
+        void load() {
+            if (cur) {
+                key = key_of(cur);
+            } else {
+                key.clear();
+            }
+        }
+
+     public:
+        iterator(): cur(nullptr), root(nullptr) {}
+        iterator(Node *N, Node *root): cur(N), root(root) {
+            load();
+        }
+
+        iterator& operator++() {
+            cur = get_next(cur);
+            load();
+            return *this;
+        }
+
+        iterator& operator--() {
+            if (cur == nullptr) {
+                cur = rightmost(root);
+            } else {
+                cur = get_prev(cur);
+            }
+            load();
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        iterator operator--(int) {
+            iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            return cur == other.cur;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return cur != other.cur;
+        }
+
+        const std::string& operator*() const {
+            return key;
+        }
+
+        const std::string* operator->() const {
+            return &key;
+        }
+    };
+
+    RadixSet(): root(new Node()), count(0) {}
+
+    template<typename Iter>
+    RadixSet(Iter start, Iter end): RadixSet() {
+        while (start != end) {
+            insert(*start);
+            ++start;
+        }
+    }
+
+    RadixSet(std::initializer_list<std::string> elems):
+    RadixSet(elems.begin(), elems.end()) {}
+
+    RadixSet(const RadixSet &other): root(clone(other.root)), count(other.count) {}
+
+    RadixSet(RadixSet &&other): RadixSet() {
+        swap(other);
+    }
+
+    RadixSet& operator=(const RadixSet &other) {
+        if (this == &other)
+            return *this;
+        RadixSet tmp(other);
+        swap(tmp);
+        return *this;
+    }
+
+    RadixSet& operator=(RadixSet &&other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap(RadixSet &other) {
+        std::swap(root, other.root);
+        std::swap(count, other.count);
+    }
+
+    iterator begin() const {
+        return iterator(leftmost(root), root);
+    }
+
+    iterator end() const {
+        return iterator(nullptr, root);
+    }
+
+    void insert(const std::string &key) {
+        Node *N = root;
+        size_t pos = 0;
+        while (true) {
+            const std::string& p = N->prefix;
+            size_t i = 0;
+            while (i < p.size() && pos + i < key.size() && p[i] == key[pos + i])
+                ++i;
+            if (i < p.size())
+                N = split(N, i);
+            pos += i;
+            if (pos == key.size())
+                break;
+            unsigned char b = static_cast<unsigned char>(key[pos]);
+            Node *C = child(N, b);
+            if (!C) {
+                C = new Node();
+                C->prefix = key.substr(pos + 1);
+                add_child(N, b, C);
+                N = C;
+                break;
+            }
+            N = C;
+            ++pos;
+        }
+        if (N->terminal)
+            return;
+        N->terminal = true;
+        ++count;
+    }
+
+    void erase(const std::string &key) {
+        Node *N = _find(key);
+        if (!N)
+            return;
+        N->terminal = false;
+        --count;
+        if (N->parent && N->count == 0) {
+            Node *P = N->parent;
+            remove_child(P, N->byte);
+            delete N;
+            compress(P);
+        } else {
+            compress(N);
+        }
+    }
+
+    iterator find(const std::string& key) const {
+        return iterator(_find(key), root);
+    }
+
+    iterator lower_bound(const std::string& key) const {
+        return iterator(_lower_bound(key), root);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return (count == 0);
+    }
+
+    ~RadixSet() {
+        destroy(root);
+    }
+};
+
+// Engine tags for picking a set implementation per deployment:
+// BasicSet<std::string, RadixEngine> is a RadixSet, and every key type
+// gets the AVL tree by default.
+struct AvlEngine {
+    template<class ValueType>
+    struct set {
+        typedef Set<ValueType> type;
+    };
+};
+
+struct RadixEngine {
+    template<class ValueType>
+    struct set {
+        static_assert(std::is_same<ValueType, std::string>::value,
+                      "RadixEngine only stores std::string keys");
+        typedef RadixSet type;
+    };
+};
+
+template<class ValueType, class Engine = AvlEngine>
+using BasicSet = typename Engine::template set<ValueType>::type;
+
+}  // namespace avl
+
+#endif  // AVL_RADIX_H_
@@ -0,0 +1,103 @@
+// Runs the differential trace check over every Set configuration: each
+// balancing policy, with relaxed mode, lazy erase, the lookup cache and the
+// hash index each off or on. Given trace files, replays those instead of
+// the built-in random traces. Stops at the first failure, saving its trace
+// to failed.trace; -t also prints per-operation timings.
+//
+//     g++ -std=c++17 -O2 avl_trace_check.cpp -o avl_trace_check
+//     ./avl_trace_check [-t] [trace-file...]
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "avl_harness.h"
+
+namespace {
+
+typedef std::vector<std::pair<std::string, avl::Trace> > TraceList;
+
+template<class Balance>
+bool check_all(const char *policy, const std::string &origin,
+               const avl::Trace &trace) {
+    for (int m = 0; m < 16; ++m) {
+        avl::Set<long, Balance> set;
+        if (m & 1)
+            set.set_slack(7);
+        if (m & 2)
+            set.set_lazy_erase(0.3);
+        if (m & 4)
+            set.set_cache(64);
+        if (m & 8)
+            set.set_hash_index(true);
+        avl::TraceResult res = avl::check_trace(trace, set, 1);
+        if (res.ok)
+            continue;
+        std::cerr << origin << ", " << policy
+                  << ((m & 1) ? ", slack 7" : "")
+                  << ((m & 2) ? ", lazy erase" : "")
+                  << ((m & 4) ? ", cache" : "")
+                  << ((m & 8) ? ", hash index" : "")
+                  << ": op " << res.failed_at << ": " << res.error << '\n';
+        std::ofstream out("failed.trace");
+        avl::save_trace(out, trace);
+        return false;
+    }
+    return true;
+}
+
+template<class Balance>
+void print_timing(const char *policy) {
+    avl::Set<long, Balance> set;
+    avl::TraceTiming timing =
+        avl::time_trace(avl::random_trace(200000, 1 << 20, 1), set);
+    std::cout << policy << ":\n";
+    avl::print_timing(std::cout, timing);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    bool timing = false;
+    TraceList traces;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-t") == 0) {
+            timing = true;
+            continue;
+        }
+        std::ifstream in(argv[i]);
+        avl::Trace trace;
+        avl::load_trace(in, trace);
+        if (!in.eof()) {
+            std::cerr << argv[i] << ": cannot read trace\n";
+            return 2;
+        }
+        traces.push_back({argv[i], trace});
+    }
+    if (traces.empty()) {
+        for (uint64_t seed = 1; seed <= 4; ++seed) {
+            for (int64_t range : {16, 300, 5000}) {
+                traces.push_back({"seed " + std::to_string(seed) +
+                                  ", keys < " + std::to_string(range),
+                                  avl::random_trace(4000, range, seed)});
+            }
+        }
+    }
+    for (const auto &t : traces) {
+        if (!check_all<avl::AvlBalance>("avl", t.first, t.second) ||
+            !check_all<avl::WeightBalance>("weight", t.first, t.second) ||
+            !check_all<avl::WavlBalance>("wavl", t.first, t.second))
+            return 1;
+    }
+    std::cout << traces.size() << " traces ok in 48 configurations\n";
+    if (timing) {
+        print_timing<avl::AvlBalance>("avl");
+        print_timing<avl::WeightBalance>("weight");
+        print_timing<avl::WavlBalance>("wavl");
+    }
+    return 0;
+}
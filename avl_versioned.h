@@ -0,0 +1,355 @@
+#ifndef AVL_VERSIONED_H_
+#define AVL_VERSIONED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+namespace avl {
+
+// Multi-version AVL set. Every change path-copies the tree and commits it as
+// a new version, so a Snapshot sees a frozen tree for as long as it lives
+// and never takes a lock while reading. Writes must come from one thread at
+// a time; snapshots may be taken and read from any thread.
+template<class ValueType>
+class VersionedSet {
+ public:
+    typedef uint64_t version_t;
+
+ private:
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+
+    struct Node {
+        ValueType key;
+        NodePtr L, R;
+        size_t height;
+        size_t size;
+
+        Node(ValueType key, NodePtr L, NodePtr R):
+        key(std::move(key)),
+        L(std::move(L)),
+        R(std::move(R)),
+        height(std::max(get_height(this->L), get_height(this->R)) + 1),
+        size(get_size(this->L) + get_size(this->R) + 1) {}
+    };
+
+    static size_t get_height(const NodePtr& N) {
+        return (N ? N->height : 0);
+    }
+
+    static size_t get_size(const NodePtr& N) {
+        return (N ? N->size : 0);
+    }
+
+    static NodePtr make(const ValueType& key, NodePtr L, NodePtr R) {
+        return std::make_shared<const Node>(key, std::move(L), std::move(R));
+    }
+
+    static int get_balance(const NodePtr& L, const NodePtr& R) {
+        return static_cast<int>(get_height(L)) - static_cast<int>(get_height(R));
+    }
+
+    // Makes a node over L and R, rotating with fresh copies if they differ
+    // in height by two.
+    static NodePtr balance(const ValueType& key, NodePtr L, NodePtr R) {
+        int bal = get_balance(L, R);
+
+        if (bal > 1) {
+            if (get_balance(L->L, L->R) >= 0) {  // LL
+                return make(L->key, L->L, make(key, L->R, std::move(R)));
+            } else {  // LR
+                const NodePtr& C = L->R;
+                return make(C->key, make(L->key, L->L, C->L),
+                            make(key, C->R, std::move(R)));
+            }
+        } else if (bal < -1) {
+            if (get_balance(R->L, R->R) <= 0) {  // RR
+                return make(R->key, make(key, std::move(L), R->L), R->R);
+            } else {  // RL
+                const NodePtr& C = R->L;
+                return make(C->key, make(key, std::move(L), C->L),
+                            make(R->key, C->R, R->R));
+            }
+        }
+
+        return make(key, std::move(L), std::move(R));
+    }
+
+    static NodePtr _insert(const NodePtr& N, const ValueType& key,
+                           bool &changed) {
+        if (!N) {
+            changed = true;
+            return make(key, nullptr, nullptr);
+        }
+        if (key < N->key) {
+            NodePtr L = _insert(N->L, key, changed);
+            return (changed ? balance(N->key, std::move(L), N->R) : N);
+        } else if (N->key < key) {
+            NodePtr R = _insert(N->R, key, changed);
+            return (changed ? balance(N->key, N->L, std::move(R)) : N);
+        }
+        return N;
+    }
+
+    static NodePtr _remove_min(const NodePtr& N, const Node *&M) {
+        if (!(N->L)) {
+            M = N.get();
+            return N->R;
+        }
+        return balance(N->key, _remove_min(N->L, M), N->R);
+    }
+
+    static NodePtr _erase(const NodePtr& N, const ValueType& key,
+                          bool &changed) {
+        if (!N)
+            return nullptr;
+        if (key < N->key) {
+            NodePtr L = _erase(N->L, key, changed);
+            return (changed ? balance(N->key, std::move(L), N->R) : N);
+        } else if (N->key < key) {
+            NodePtr R = _erase(N->R, key, changed);
+            return (changed ? balance(N->key, N->L, std::move(R)) : N);
+        }
+        changed = true;
+        if (!(N->L) || !(N->R))
+            return (N->L ? N->L : N->R);
+        const Node *M = nullptr;
+        NodePtr R = _remove_min(N->R, M);
+        return balance(M->key, N->L, std::move(R));
+    }
+
+    mutable std::mutex lock;
+    std::mutex write_lock;
+    std::map<version_t, NodePtr> versions;
+    std::multiset<version_t> readers;
+    version_t latest;
+
+    void release(version_t v) {
+        std::lock_guard<std::mutex> guard(lock);
+        readers.erase(readers.find(v));
+    }
+
+    template<class Op>
+    version_t commit(const ValueType& key, Op op) {
+        std::lock_guard<std::mutex> write_guard(write_lock);
+        NodePtr cur;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            cur = versions.rbegin()->second;
+        }
+        bool changed = false;
+        NodePtr next = op(cur, key, changed);
+        std::lock_guard<std::mutex> guard(lock);
+        if (changed)
+            versions.emplace(++latest, std::move(next));
+        return latest;
+    }
+
+ public:
+    class iterator {
+     private:
+        std::vector<const Node *> path;
+
+        friend class VersionedSet;
+
+        void descend(const Node *N) {
+            while (N) {
+                path.push_back(N);
+                N = N->L.get();
+            }
+        }
+
+     public:
+        iterator() {}
+
+        iterator& operator++() {
+            const Node *N = path.back();
+            path.pop_back();
+            descend(N->R.get());
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            if (path.empty() || other.path.empty())
+                return path.empty() == other.path.empty();
+            return path.back() == other.path.back();
+        }
+
+        bool operator!=(const iterator& other) const {
+            return !(*this == other);
+        }
+
+        const ValueType& operator*() const {
+            return path.back()->key;
+        }
+
+        const ValueType* operator->() const {
+            return &(path.back()->key);
+        }
+    };
+
+    // A read-only view of one version. The owning set must outlive it.
+    class Snapshot {
+     private:
+        VersionedSet *owner;
+        NodePtr root;
+        version_t ver;
+
+        friend class VersionedSet;
+
+        Snapshot(VersionedSet *owner, NodePtr root, version_t ver):
+        owner(owner),
+        root(std::move(root)),
+        ver(ver) {}
+
+     public:
+        Snapshot(Snapshot&& other):
+        owner(other.owner),
+        root(std::move(other.root)),
+        ver(other.ver) {
+            other.owner = nullptr;
+        }
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot& operator=(Snapshot&&) = delete;
+
+        ~Snapshot() {
+            if (owner)
+                owner->release(ver);
+        }
+
+        version_t version() const {
+            return ver;
+        }
+
+        iterator begin() const {
+            iterator it;
+            it.descend(root.get());
+            return it;
+        }
+
+        iterator end() const {
+            return iterator();
+        }
+
+        // Keeps the path to the first key not less than val, so iteration
+        // continues from there.
+        iterator lower_bound(const ValueType& val) const {
+            iterator it;
+            const Node *N = root.get();
+            while (N) {
+                if (N->key < val) {
+                    N = N->R.get();
+                } else {
+                    it.path.push_back(N);
+                    if (!(val < N->key))
+                        break;
+                    N = N->L.get();
+                }
+            }
+            return it;
+        }
+
+        iterator find(const ValueType& val) const {
+            iterator it = lower_bound(val);
+            if (it != end() && val < *it)
+                return end();
+            return it;
+        }
+
+        bool contains(const ValueType& val) const {
+            return find(val) != end();
+        }
+
+        size_t size() const {
+            return get_size(root);
+        }
+
+        bool empty() const {
+            return !root;
+        }
+    };
+
+    VersionedSet(): latest(0) {
+        versions.emplace(0, nullptr);
+    }
+
+    VersionedSet(const VersionedSet&) = delete;
+    VersionedSet& operator=(const VersionedSet&) = delete;
+
+    // Both return the version the change was committed as, or the current
+    // version if the set was left unchanged.
+    version_t insert(const ValueType& val) {
+        return commit(val, &VersionedSet::_insert);
+    }
+
+    version_t erase(const ValueType& val) {
+        return commit(val, &VersionedSet::_erase);
+    }
+
+    version_t version() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return latest;
+    }
+
+    Snapshot snapshot() {
+        std::lock_guard<std::mutex> guard(lock);
+        readers.insert(latest);
+        return Snapshot(this, versions.rbegin()->second, latest);
+    }
+
+    // The set as of version v, i.e. after the last commit not newer than v.
+    // Throws std::out_of_range if that version has been collected or is
+    // not committed yet.
+    Snapshot snapshot(version_t v) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (v > latest)
+            throw std::out_of_range("avl::VersionedSet: version not committed");
+        auto it = versions.upper_bound(v);
+        if (it == versions.begin())
+            throw std::out_of_range("avl::VersionedSet: version collected");
+        --it;
+        readers.insert(v);
+        return Snapshot(this, it->second, v);
+    }
+
+    // Drops versions no live snapshot can still ask for. Nodes shared with
+    // retained versions or held by snapshots survive through their counts.
+    size_t gc() {
+        std::lock_guard<std::mutex> guard(lock);
+        version_t oldest = (readers.empty() ? latest : *readers.begin());
+        auto keep = versions.upper_bound(oldest);
+        --keep;
+        size_t dropped = 0;
+        auto it = versions.begin();
+        while (it != keep) {
+            it = versions.erase(it);
+            ++dropped;
+        }
+        return dropped;
+    }
+
+    size_t retained() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return versions.size();
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_VERSIONED_H_
@@ -0,0 +1,72 @@
+#ifndef AVL_WINDOW_H_
+#define AVL_WINDOW_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "avl.h"
+
+namespace avl {
+
+// Set of time-ordered keys from which everything older than a cutoff is
+// dropped with one split instead of a series of erases.
+template<class ValueType>
+class SlidingWindow {
+ private:
+    Set<ValueType> keys;
+
+ public:
+    typedef typename Set<ValueType>::iterator iterator;
+
+    SlidingWindow() {}
+
+    explicit SlidingWindow(std::pmr::memory_resource *res): keys(res) {}
+
+    void insert(const ValueType& t) {
+        keys.insert(t);
+    }
+
+    // Drops every key less than t0 and returns how many were dropped.
+    size_t expire_before(const ValueType& t0) {
+        return keys.erase_before(t0);
+    }
+
+    iterator begin() const {
+        return keys.begin();
+    }
+
+    iterator end() const {
+        return keys.end();
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    bool empty() const {
+        return keys.empty();
+    }
+
+    // Number of keys in the window less than t.
+    size_t rank(const ValueType& t) const {
+        return keys.rank(t);
+    }
+
+    iterator nth(size_t k) const {
+        return keys.nth(k);
+    }
+
+    // The key at fraction q of the window (0 is the oldest, 1 the newest),
+    // or end() if the window is empty.
+    iterator quantile(double q) const {
+        return keys.quantile(q);
+    }
+
+    std::vector<iterator> quantiles(const std::vector<double>& qs) const {
+        return keys.quantiles(qs);
+    }
+};
+
+}  // namespace avl
+
+#endif  // AVL_WINDOW_H_